@@ -0,0 +1,291 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "collector.h"
+#include "monitor.h"
+
+namespace sysmon {
+
+const uint32_t Collector::kEndOfSnapshot;
+const size_t Collector::kHeaderSize;
+const size_t Collector::kMaxChunk;
+const size_t Collector::kMaxMessage;
+const mode_t Collector::kSocketMode;
+const size_t Collector::kMaxFiles;
+const size_t Collector::kMaxClients;
+const uint64_t Collector::kSubscribeTimeout;
+const uint64_t Collector::kSlack;
+
+void Collector::Append(std::string &msg, uint32_t v)
+{
+  msg.append((const char *) &v, sizeof(v));
+}
+
+bool Collector::Fetch(const char *&p, const char *end, uint32_t &v)
+{
+  if (end - p < (long) sizeof(v))
+    return false;
+  memcpy(&v, p, sizeof(v));
+  p += sizeof(v);
+  return true;
+}
+
+Collector::Collector(std::string path)
+    : path(path), rbuf(kMaxMessage)
+{
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    std::abort();
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || chmod(path.c_str(), kSocketMode) < 0
+      || listen(listen_fd, 16) < 0) {
+    perror("bind");
+    std::abort();
+  }
+}
+
+Collector::~Collector()
+{
+  for (auto &c: clients) {
+    close(c.fd);
+  }
+  close(listen_fd);
+  unlink(path.c_str());
+  for (auto &p: entries) {
+    delete p.second;
+  }
+}
+
+static bool IsProcOrSys(const std::string &path)
+{
+  return path.compare(0, 6, "/proc/") == 0 || path.compare(0, 5, "/sys/") == 0;
+}
+
+// Anyone who can reach the socket gets these, so only hand out what every
+// user can read anyway. Process directories are ours and say more than the
+// mode bits suggest (root, environ), so they are out too. real is where the
+// file actually is, once symlinks are followed.
+bool Collector::Allowed(const std::string &file, std::string &real)
+{
+  if (!IsProcOrSys(file) || file.find("..") != std::string::npos)
+    return false;
+  if (file.compare(0, 6, "/proc/") == 0) {
+    auto dir = file.substr(6, file.find('/', 6) - 6);
+    if (dir.empty() || isdigit(dir[0]) || dir == "self" || dir == "thread-self")
+      return false;
+  }
+  char buf[PATH_MAX];
+  if (realpath(file.c_str(), buf) == nullptr)
+    return false;
+  real = buf;
+  struct stat st;
+  return IsProcOrSys(real) && stat(buf, &st) == 0
+      && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH);
+}
+
+// Takes a reference, see Release().
+Collector::Entry *Collector::Lookup(const std::string &file)
+{
+  std::string real;
+  if (!Allowed(file, real))
+    return nullptr;
+  auto it = entries.find(real);
+  if (it != entries.end()) {
+    it->second->refs++;
+    return it->second;
+  }
+  auto e = new Entry();
+  e->path = real;
+  e->refs = 1;
+  bool ok = sampler.Register(real, [e](const char *buf, size_t len) {
+      if (e->content.compare(0, std::string::npos, buf, len) != 0) {
+        e->content.assign(buf, len);
+        e->version++;
+      }
+    });
+  if (!ok) {
+    delete e;
+    return nullptr;
+  }
+  entries[real] = e;
+  return e;
+}
+
+// Files nobody subscribes to any more are no longer read.
+void Collector::Release(Client &c)
+{
+  for (auto e: c.entries) {
+    if (e == nullptr || --e->refs > 0)
+      continue;
+    sampler.Unregister(e->path);
+    entries.erase(e->path);
+    delete e;
+  }
+  c.entries.clear();
+}
+
+void Collector::Accept()
+{
+  int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (clients.size() >= kMaxClients) {
+    close(fd);
+    return;
+  }
+  // A whole snapshot should fit, otherwise the rest waits for the next one.
+  int sndbuf = 1 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  Client c;
+  c.fd = fd;
+  c.next = NowNanos() + kSubscribeTimeout;
+  clients.push_back(c);
+}
+
+bool Collector::Subscribe(Client &c, const char *buf, size_t len)
+{
+  const char *p = buf, *end = buf + len;
+  uint32_t interval, n;
+  if (!Fetch(p, end, interval) || !Fetch(p, end, n) || n > kMaxFiles)
+    return false;
+  // Look up the new files before releasing the old ones, so that the files
+  // in both are not closed and opened again.
+  std::vector<Entry *> old;
+  old.swap(c.entries);
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t l;
+    if (!Fetch(p, end, l) || (size_t) (end - p) < l) {
+      Release(c);
+      c.entries.swap(old);
+      return false;
+    }
+    c.entries.push_back(Lookup(std::string(p, l)));
+    p += l;
+  }
+  old.swap(c.entries);
+  Release(c);
+  c.entries.swap(old);
+  // Indices changed, start over with a full snapshot.
+  c.sent.assign(n, 0);
+  c.interval = std::max<uint32_t>(10, interval);
+  c.next = NowNanos();
+  return true;
+}
+
+// False if the client is gone. A full socket only cuts this snapshot short,
+// whatever was not sent goes out with the next one.
+bool Collector::Send(Client &c)
+{
+  std::string msg;
+  for (size_t i = 0; i < c.entries.size(); i++) {
+    auto e = c.entries[i];
+    if (e == nullptr || c.sent[i] == e->version)
+      continue;
+    size_t total = e->content.length();
+    for (size_t off = 0; off < total; off += kMaxChunk) {
+      msg.clear();
+      Append(msg, i);
+      Append(msg, off);
+      Append(msg, total);
+      msg.append(e->content, off, kMaxChunk);
+      if (send(c.fd, msg.data(), msg.length(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    c.sent[i] = e->version;
+  }
+  msg.clear();
+  Append(msg, kEndOfSnapshot);
+  Append(msg, 0);
+  Append(msg, 0);
+  if (send(c.fd, msg.data(), msg.length(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  return true;
+}
+
+void Collector::Run()
+{
+  std::vector<struct pollfd> fds;
+  while (true) {
+    uint64_t now = NowNanos();
+    int timeout = -1;
+    fds.clear();
+    fds.push_back(pollfd{listen_fd, POLLIN, 0});
+    for (auto &c: clients) {
+      fds.push_back(pollfd{c.fd, POLLIN, 0});
+      int ms = c.next > now ? (c.next - now + 999999) / 1000000 : 0;
+      timeout = timeout < 0 ? ms : std::min(timeout, ms);
+    }
+
+    int ret = poll(fds.data(), fds.size(), timeout);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      std::abort();
+    }
+
+    std::vector<bool> dead(clients.size(), false);
+    for (size_t i = 0; i < clients.size(); i++) {
+      auto revents = fds[i + 1].revents;
+      if (revents & POLLIN) {
+        ssize_t rs = recv(clients[i].fd, rbuf.data(), rbuf.size(), MSG_DONTWAIT);
+        if (rs == 0 || (rs < 0 && errno != EAGAIN && errno != EINTR)
+            || (rs > 0 && !Subscribe(clients[i], rbuf.data(), rs)))
+          dead[i] = true;
+      } else if (revents & (POLLHUP | POLLERR)) {
+        dead[i] = true;
+      }
+    }
+
+    now = NowNanos();
+    bool sampled = false;
+    for (size_t i = 0; i < clients.size(); i++) {
+      auto &c = clients[i];
+      if (c.interval == 0 && c.next <= now)
+        dead[i] = true;
+      if (dead[i] || c.interval == 0 || c.next > now + kSlack)
+        continue;
+      if (!sampled) {
+        sampler.Sample();
+        sampled = true;
+      }
+      if (!Send(c))
+        dead[i] = true;
+      // Keep the phase, unless we fell behind by more than one interval.
+      c.next += c.interval * 1000000ULL;
+      if (c.next < now)
+        c.next = now + c.interval * 1000000ULL;
+    }
+
+    for (size_t i = clients.size(); i-- > 0;) {
+      if (dead[i]) {
+        Release(clients[i]);
+        close(clients[i].fd);
+        clients.erase(clients.begin() + i);
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+      Accept();
+  }
+}
+
+}
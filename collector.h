@@ -0,0 +1,86 @@
+// -*- mode: c++ -*-
+
+#ifndef COLLECTOR_H
+#define COLLECTOR_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sampler.h"
+
+namespace sysmon {
+
+// Reads the files of every connected bar once and sends each bar only what
+// changed since its last snapshot, so bars on several displays share one set
+// of reads.
+//
+// On a SOCK_SEQPACKET socket a bar subscribes with
+//   [u32 interval_ms][u32 n] n * ([u32 len][path])
+// and then receives chunks [u32 index][u32 offset][u32 total][data], each
+// snapshot closed by a chunk with index kEndOfSnapshot. A file cut short by a
+// full socket is sent again from offset 0 with the next snapshot.
+//
+// The socket is created kSocketMode, so that the bars of every user on the
+// machine can connect. That is safe because Allowed() only hands out world
+// readable files, and the collector refuses to run as root, whose view of
+// some of them differs.
+class Collector {
+ public:
+  static const uint32_t kEndOfSnapshot = 0xffffffff;
+  static const size_t kHeaderSize = 12;
+  static const size_t kMaxChunk = 65536;
+  static const size_t kMaxMessage = kHeaderSize + kMaxChunk;
+  static const mode_t kSocketMode = 0666;
+  // Every file is read at the rate of the fastest client, so nobody gets to
+  // add files without bound.
+  static const size_t kMaxFiles = 1024; // per client
+  static const size_t kMaxClients = 64;
+  // Connections that never subscribe would otherwise hold a slot forever.
+  static const uint64_t kSubscribeTimeout = 5000000000ULL; // ns
+
+  static void Append(std::string &msg, uint32_t v);
+  static bool Fetch(const char *&p, const char *end, uint32_t &v);
+
+  Collector(std::string path);
+  ~Collector();
+
+  void Run();
+ private:
+  struct Entry {
+    std::string path; // resolved
+    std::string content;
+    uint64_t version = 0;
+    int refs = 0;
+  };
+  struct Client {
+    int fd;
+    int interval = 0; // 0 until subscribed
+    uint64_t next = 0; // the deadline to subscribe by until then
+    std::vector<Entry *> entries;
+    std::vector<uint64_t> sent;
+  };
+
+  std::string path;
+  int listen_fd;
+  Sampler sampler;
+  std::map<std::string, Entry *> entries;
+  std::vector<Client> clients;
+  std::vector<char> rbuf;
+
+  // Clients due this close together are served from the same read.
+  static const uint64_t kSlack = 20000000ULL;
+
+  void Accept();
+  bool Subscribe(Client &c, const char *buf, size_t len);
+  bool Send(Client &c);
+  Entry *Lookup(const std::string &file);
+  void Release(Client &c);
+  static bool Allowed(const std::string &file, std::string &real);
+};
+
+}
+
+#endif
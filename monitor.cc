@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <poll.h>
 #include <climits>
+#include <csignal>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <fstream>
@@ -12,8 +14,13 @@
 
 #include <X11/extensions/Xrandr.h>
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
+#include <xcb/randr.h>
 
 #include "monitor.h"
+#include "collector.h"
 
 namespace sysmon {
 
@@ -22,19 +29,19 @@ double RenderContext::g_dpi_scale = 1.0;
 long RenderContext::Translate(Widget *w, long offset)
 {
   if (w->align.type == AlignmentType::Left) {
-    return std::lrint((w->align.pos + offset) * g_dpi_scale);
+    return w->align.px + std::lrint(offset * g_dpi_scale);
   } else if (w->align.type == AlignmentType::Right) {
-    return std::lrint(window_length - g_dpi_scale * (w->align.pos + w->Width()) + g_dpi_scale * offset);
+    return window_length - w->align.px + std::lrint(offset * g_dpi_scale);
   } else {
     abort();
   }
 }
 
-RenderContext *RenderContext::DrawText(Widget *w, std::string str, long offset)
+RenderContext *RenderContext::DrawText(Widget *w, const char *str, size_t len, long offset)
 {
   XftDrawStringUtf8(draw, &color, font,
                     Translate(w, offset), std::lrint(0.75 * Bar::g_height),
-                    (const FcChar8 *) str.c_str(), str.length());
+                    (const FcChar8 *) str, len);
   return this;
 }
 
@@ -45,21 +52,90 @@ RenderContext *RenderContext::DrawBlock(Widget *w, long offset, size_t length)
   return this;
 }
 
+RenderContext *RenderContext::DrawColumn(Widget *w, long offset, size_t width, double fill, double base)
+{
+  // Bottom aligned, spanning the same band as DrawBlock() when full. A
+  // non-zero base stacks this segment on top of earlier ones.
+  auto band = 0.5 * Bar::g_height, bottom = 0.75 * Bar::g_height;
+  long top = std::lrint(bottom - std::min(1.0, base + fill) * band);
+  long h = std::lrint(bottom - std::min(1.0, base) * band) - top;
+  if (h <= 0) return this;
+  XftDrawRect(draw, &color, Translate(w, offset), top,
+              std::max(1L, std::lrint(g_dpi_scale * width)), h);
+  return this;
+}
+
 RenderContext *RenderContext::DrawBitmap(Widget *w, Pixmap bitmap, size_t width, size_t height, long offset)
 {
-  XCopyPlane(dpy, bitmap, win, XDefaultGC(dpy, 0), 0, 0, width, height,
+  XCopyPlane(dpy, bitmap, target, XDefaultGC(dpy, 0), 0, 0, width, height,
              Translate(w, offset), (Bar::g_height - height) / 2, 1);
   return this;
 }
 
+long RenderContext::TextWidth(const char *str, size_t len)
+{
+  XGlyphInfo ext;
+  XftTextExtentsUtf8(dpy, font, (const FcChar8 *) str, len, &ext);
+  return std::lrint(ext.xOff / g_dpi_scale);
+}
+
+void RenderContext::BeginLayer()
+{
+  if (layer == None || layer_length != window_length) {
+    if (layer != None) XFreePixmap(dpy, layer);
+    layer = XCreatePixmap(dpy, win, window_length, Bar::g_height, XDefaultDepth(dpy, 0));
+    layer_length = window_length;
+  }
+  XFillRectangle(dpy, layer, gc, 0, 0, layer_length, Bar::g_height);
+  target = layer;
+  XftDrawChange(draw, layer);
+}
+
+void RenderContext::EndLayer()
+{
+  target = win;
+  XftDrawChange(draw, win);
+  layer_dirty = false;
+}
+
+// Covers the whole window, so no need to clear it first.
+void RenderContext::CopyLayer()
+{
+  XCopyArea(dpy, layer, win, gc, 0, 0, layer_length, Bar::g_height, 0, 0);
+}
+
 Bar::Bar(Display *dpy)
     : dpy(dpy)
 {
-  pos.fill(0);
+  sample_hz = g_sample_hz;
+  RegisterCommand("sample-stats", [=]() {
+      printf("sampling at %dHz, %lluus avg %lluus max\n", sample_hz,
+             (unsigned long long) last_cost_avg / 1000,
+             (unsigned long long) last_cost_max / 1000);
+      for (size_t i = 0; i < widgets.size(); i++) {
+        printf("widget %zu: every %d ticks, %lluus\n",
+               i, widgets[i]->interval, (unsigned long long) widgets[i]->last_cost / 1000);
+      }
+    });
   font = XftFontOpen(dpy, XDefaultScreen(dpy),
                      XFT_FAMILY, XftTypeString, "Sans",
                      XFT_SIZE, XftTypeDouble, 10.0,
                      nullptr);
+
+  // Intern everything in one round trip instead of one per window.
+  const char *atom_names[NrAtoms] = {
+    "_NET_WM_WINDOW_TYPE_DOCK",
+    "_NET_WM_WINDOW_TYPE",
+    "_MOTIF_WM_HINTS",
+    "_NET_WM_STRUT",
+    "_NET_ACTIVE_WINDOW",
+    "_NET_WM_STATE",
+    "_NET_WM_STATE_FULLSCREEN",
+  };
+  XInternAtoms(dpy, (char **) atom_names, NrAtoms, 0, atoms);
+
+  int dpms_event, dpms_error;
+  has_dpms = DPMSQueryExtension(dpy, &dpms_event, &dpms_error) && DPMSCapable(dpy);
 }
 
 Pixmap Bar::LoadBitmap(const uint8_t *data, unsigned int width, unsigned int height)
@@ -72,7 +148,7 @@ Window Bar::CreateWindow(int x, int y, int width, int height)
 {
   XSetWindowAttributes attr;
   attr.background_pixel = 0;
-  attr.event_mask = ExposureMask;
+  attr.event_mask = ExposureMask | VisibilityChangeMask;
   attr.override_redirect = 1;
 
   auto w = XCreateWindow(
@@ -81,19 +157,19 @@ Window Bar::CreateWindow(int x, int y, int width, int height)
       CWBackPixel | CWEventMask, &attr);
 
   Atom props[] = {
-    XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DOCK", 0),
+    atoms[NetWmWindowTypeDockAtom],
   };
 
   XChangeProperty(
       dpy, w,
-      XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", 0), XA_ATOM, 32,
+      atoms[NetWmWindowTypeAtom], XA_ATOM, 32,
       PropModeAppend, (unsigned char *) props, sizeof(props) / sizeof(Atom));
 
   unsigned long mwm_decor[] = {
     0x02, 0, 0, 0, 0
   };
 
-  Atom mwm = XInternAtom(dpy, "_MOTIF_WM_HINTS", 0);
+  Atom mwm = atoms[MotifWmHintsAtom];
 
   XChangeProperty(
       dpy, w,
@@ -111,7 +187,7 @@ Window Bar::CreateWindow(int x, int y, int width, int height)
 
   XChangeProperty(
       dpy, w,
-      XInternAtom(dpy, "_NET_WM_STRUT", 0), XA_CARDINAL, 32,
+      atoms[NetWmStrutAtom], XA_CARDINAL, 32,
       PropModeReplace, (unsigned char *) struts, 4);
 
   XSizeHints hints;
@@ -124,79 +200,427 @@ Window Bar::CreateWindow(int x, int y, int width, int height)
 
 void Bar::Configure()
 {
-  for (auto c: ctxs) {
-    auto w = c->win;
-    delete c;
-    XUnmapWindow(dpy, w);
-    XDestroyWindow(dpy, w);
-  }
-  ctxs.clear();
-
-  XRRScreenResources *sres =
-      XRRGetScreenResources(dpy, XDefaultRootWindow(dpy));
+  // Go through XCB so that all CRTC queries are in flight at once. The
+  // current resources also do not make the server probe the outputs.
+  auto conn = XGetXCBConnection(dpy);
+  auto sres = xcb_randr_get_screen_resources_current_reply(
+      conn,
+      xcb_randr_get_screen_resources_current(conn, XDefaultRootWindow(dpy)),
+      nullptr);
+  if (sres == nullptr)
+    return;
 
   XSetForeground(dpy, XDefaultGC(dpy, 0),
                  std::numeric_limits<unsigned long>::max());
   XSetBackground(dpy, XDefaultGC(dpy, 0), 0);
 
-  std::vector<XRRCrtcInfo *> all_sinfo;
+  int ncrtc = xcb_randr_get_screen_resources_current_crtcs_length(sres);
+  auto crtcs = xcb_randr_get_screen_resources_current_crtcs(sres);
+  std::vector<xcb_randr_get_crtc_info_cookie_t> cookies;
+  for (int i = 0; i < ncrtc; i++) {
+    cookies.push_back(xcb_randr_get_crtc_info(conn, crtcs[i], sres->config_timestamp));
+  }
+
+  std::vector<std::pair<xcb_randr_crtc_t, xcb_randr_get_crtc_info_reply_t *>> all_sinfo;
 
   int max_h = 0, max_w = 0;
-  for (int i = 0; i < sres->ncrtc; i++) {
-    XRRCrtcInfo *sinfo = XRRGetCrtcInfo(dpy, sres, sres->crtcs[i]);
+  for (int i = 0; i < ncrtc; i++) {
+    auto sinfo = xcb_randr_get_crtc_info_reply(conn, cookies[i], nullptr);
     if (sinfo == nullptr)
       continue;
-    if (sinfo->noutput > 0) {
+    if (sinfo->num_outputs > 0) {
       max_w = std::max(max_w, (int) sinfo->width + sinfo->x);
       max_h = std::max(max_h, (int) sinfo->height + sinfo->y);
-      all_sinfo.push_back(sinfo);
+      all_sinfo.emplace_back(crtcs[i], sinfo);
     } else {
-      XRRFreeCrtcInfo(sinfo);
+      free(sinfo);
     }
   }
 
-  for (auto sinfo: all_sinfo) {
+  // Diff the CRTCs against the windows we already have. Surviving windows are
+  // moved in place, so only new or vanished outputs create or destroy windows.
+  std::vector<RenderContext *> old_ctxs;
+  old_ctxs.swap(ctxs);
+
+  for (auto &p: all_sinfo) {
+    auto sinfo = p.second;
     if (g_all_screens
         || (g_screen_top && sinfo->y == 0)
         || (!g_screen_top && sinfo->y + sinfo->height == max_h)) {
       int y = g_screen_top ? 0 : max_h - g_height;
-      auto w = CreateWindow(sinfo->x, y, sinfo->width, g_height);
-      XMapWindow(dpy, w);
-      ctxs.push_back(new RenderContext(dpy, font, w, sinfo->width));
+      auto it = std::find_if(
+          old_ctxs.begin(), old_ctxs.end(),
+          [=](RenderContext *c) { return c->crtc == p.first; });
+      RenderContext *ctx;
+      if (it != old_ctxs.end()) {
+        ctx = *it;
+        old_ctxs.erase(it);
+        if (ctx->x != sinfo->x || ctx->y != y || ctx->window_length != sinfo->width) {
+          XMoveResizeWindow(dpy, ctx->win, sinfo->x, y, sinfo->width, g_height);
+        }
+      } else {
+        auto w = CreateWindow(sinfo->x, y, sinfo->width, g_height);
+        XMapWindow(dpy, w);
+        ctx = new RenderContext(dpy, font, w, sinfo->width);
+        ctx->crtc = p.first;
+      }
+      ctx->x = sinfo->x;
+      ctx->y = y;
+      ctx->window_length = sinfo->width;
+      ctx->layer_dirty = true; // right aligned widgets moved
+      ctxs.push_back(ctx);
     }
-    XRRFreeCrtcInfo(sinfo);
+    free(sinfo);
+  }
+  free(sres);
+
+  for (auto c: old_ctxs) {
+    auto w = c->win;
+    delete c;
+    XUnmapWindow(dpy, w);
+    XDestroyWindow(dpy, w);
   }
-  XRRFreeScreenResources(sres);
   puts("configured");
 }
 
+bool Bar::Suspended()
+{
+  if (screensaver_on || dpms_off)
+    return true;
+  for (auto ctx: ctxs) {
+    if (ctx->visible && !ctx->covered)
+      return false;
+  }
+  return true;
+}
+
+void Bar::OnVisibility(const XVisibilityEvent &evt)
+{
+  for (auto ctx: ctxs) {
+    if (ctx->win == evt.window)
+      ctx->visible = evt.state != VisibilityFullyObscured;
+  }
+}
+
+void Bar::OnProperty(const XPropertyEvent &evt)
+{
+  if ((evt.window == XDefaultRootWindow(dpy) && evt.atom == atoms[NetActiveWindowAtom])
+      || (evt.window == active_win && evt.atom == atoms[NetWmStateAtom])) {
+    UpdateFullscreen();
+  }
+}
+
+// Compositors keep reporting us as unobscured, so look for a fullscreen
+// active window ourselves.
+void Bar::UpdateFullscreen()
+{
+  Window root = XDefaultRootWindow(dpy);
+  Atom type;
+  int format;
+  unsigned long nitems, remain;
+  unsigned char *data = nullptr;
+
+  Window active = None;
+  if (XGetWindowProperty(dpy, root, atoms[NetActiveWindowAtom], 0, 1, 0, XA_WINDOW,
+                         &type, &format, &nitems, &remain, &data) == Success && data) {
+    if (nitems > 0) active = *(Window *) data;
+    XFree(data);
+  }
+  if (active != active_win) {
+    if (active_win != None)
+      XSelectInput(dpy, active_win, NoEventMask);
+    if (active != None)
+      XSelectInput(dpy, active, PropertyChangeMask);
+    active_win = active;
+  }
+
+  bool fullscreen = false;
+  data = nullptr;
+  if (active != None
+      && XGetWindowProperty(dpy, active, atoms[NetWmStateAtom], 0, 64, 0, XA_ATOM,
+                            &type, &format, &nitems, &remain, &data) == Success && data) {
+    for (unsigned long i = 0; i < nitems; i++) {
+      if (((Atom *) data)[i] == atoms[NetWmStateFullscreenAtom])
+        fullscreen = true;
+    }
+    XFree(data);
+  }
+
+  int x = 0, y = 0;
+  unsigned int w = 0, h = 0, border, depth;
+  Window child;
+  if (fullscreen) {
+    XGetGeometry(dpy, active, &child, &x, &y, &w, &h, &border, &depth);
+    XTranslateCoordinates(dpy, active, root, 0, 0, &x, &y, &child);
+  }
+  // Outputs may be side by side or stacked, the window has to cover the
+  // whole bar both ways.
+  for (auto ctx: ctxs) {
+    ctx->covered = fullscreen
+                   && x <= ctx->x && ctx->x + (long) ctx->window_length <= x + (long) w
+                   && y <= ctx->y && ctx->y + (long) g_height <= y + (long) h;
+  }
+}
+
+void Bar::UpdateDPMS()
+{
+  if (!has_dpms)
+    return;
+  CARD16 level;
+  BOOL enabled;
+  dpms_off = DPMSInfo(dpy, &level, &enabled) && enabled && level != DPMSModeOn;
+}
+
+// metric>limit[:hysteresis[:duration]], or with < for lower limits. Rules
+// on metrics that are not there yet, like filesystems mounted later, wait
+// for them.
+void Bar::CompileRules()
+{
+  if (!rules_compiled)
+    pending_rules = g_rules;
+  std::vector<std::string> waiting;
+  for (auto &str: pending_rules) {
+    auto op = str.find_first_of("<>");
+    if (op == std::string::npos) {
+      fprintf(stderr, "bad rule %s\n", str.c_str());
+      continue;
+    }
+    auto metric = str.substr(0, op);
+    auto it = metrics.find(metric);
+    if (it == metrics.end()) {
+      if (!rules_compiled)
+        fprintf(stderr, "unknown metric %s, waiting for it\n", metric.c_str());
+      waiting.push_back(str);
+      continue;
+    }
+    double limit = 0, hysteresis = 0;
+    int duration = 1;
+    sscanf(str.c_str() + op + 1, "%lf:%lf:%d", &limit, &hysteresis, &duration);
+
+    AlertRule rule;
+    rule.value = &it->second.first;
+    rule.widget = it->second.second;
+    rule.above = str[op] == '>';
+    rule.limit = limit;
+    rule.clear = rule.above ? limit - hysteresis : limit + hysteresis;
+    rule.duration = std::max(1, duration);
+    rule.count = 0;
+    rule.firing = false;
+    rule.metric = metric;
+    rules.push_back(rule);
+  }
+  pending_rules.swap(waiting);
+  rules_compiled = true;
+}
+
+void Bar::EvaluateRules()
+{
+  for (auto &r: rules) {
+    double v = *r.value;
+    if (!r.firing) {
+      bool past = r.above ? v > r.limit : v < r.limit;
+      r.count = past ? r.count + 1 : 0;
+      if (r.count < r.duration) continue;
+      r.firing = true;
+      if (r.widget->nr_alerts++ == 0) InvalidateStatic(); // labels turn red
+      Alert(r, v);
+    } else if (r.above ? v < r.clear : v > r.clear) {
+      r.firing = false;
+      r.count = 0;
+      if (--r.widget->nr_alerts == 0) InvalidateStatic();
+      Alert(r, v);
+    }
+  }
+}
+
+// Best effort: nobody may be reading the FIFO, and we must never block.
+void Bar::Alert(const AlertRule &rule, double value)
+{
+  if (g_alert_fifo.empty())
+    return;
+  if (alert_fd < 0)
+    alert_fd = open(g_alert_fifo.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (alert_fd < 0)
+    return;
+  char line[256];
+  int len = snprintf(line, sizeof(line), "%ld %s %s %g\n", (long) time(NULL),
+                     rule.firing ? "fired" : "cleared", rule.metric.c_str(), value);
+  if (write(alert_fd, line, std::min<int>(len, sizeof(line) - 1)) < 0 && errno != EAGAIN) {
+    close(alert_fd);
+    alert_fd = -1;
+  }
+}
+
+void Widget::InvalidateLayout()
+{
+  if (bar) bar->InvalidateLayout();
+}
+
+long Widget::TextWidth(const char *str, size_t len)
+{
+  return bar ? bar->TextWidth(str, len) : 0;
+}
+
+void Widget::InvalidateStatic()
+{
+  if (bar) bar->InvalidateStatic();
+}
+
 void Bar::Add(Widget *wid, AlignmentType type)
 {
   widgets.push_back(wid);
+  wid->bar = this;
   wid->align.type = type;
-  wid->align.pos = pos[type];
-  pos[type] += wid->Width();
+  adding = wid;
   wid->OnAdd(this);
+  adding = nullptr;
+  layout_dirty = true;
 }
 
-void Bar::RefreshPerSecond()
+long Bar::TextWidth(const char *str, size_t len)
+{
+  XGlyphInfo ext;
+  XftTextExtentsUtf8(dpy, font, (const FcChar8 *) str, len, &ext);
+  return std::lrint(ext.xOff / RenderContext::g_dpi_scale);
+}
+
+void Bar::Layout()
+{
+  std::array<size_t, AlignmentType::AllTypes> pos;
+  pos.fill(0);
+  for (auto w: widgets) {
+    auto &align = w->align;
+    align.pos = pos[align.type];
+    align.width = w->Width();
+    pos[align.type] += align.width;
+    if (align.type == AlignmentType::Left) {
+      align.px = std::lrint(align.pos * RenderContext::g_dpi_scale);
+    } else {
+      align.px = std::lrint((align.pos + align.width) * RenderContext::g_dpi_scale);
+    }
+  }
+  layout_dirty = false;
+  InvalidateStatic();
+}
+
+void Bar::Sample()
 {
-  for (auto func: per_second_funcs) {
+  auto start = NowNanos();
+  fast_sampler.Sample();
+  for (auto func: sample_funcs) {
     func();
   }
+  auto cost = NowNanos() - start;
+  sample_cost_sum += cost;
+  sample_cost_max = std::max(sample_cost_max, cost);
+  nr_samples++;
+}
+
+void Bar::RefreshPerSecond()
+{
+  if (nr_samples > 0) {
+    // Sampling must stay cheap, back off if it takes more than a tenth of
+    // the time between samples.
+    last_cost_avg = sample_cost_sum / nr_samples;
+    last_cost_max = sample_cost_max;
+    if (last_cost_avg > SampleInterval() * 100000ULL && sample_hz > 1) {
+      sample_hz = std::max(1, sample_hz / 2);
+      printf("sampling costs %lluus, down to %dHz\n",
+             (unsigned long long) last_cost_avg / 1000, sample_hz);
+    }
+    sample_cost_sum = sample_cost_max = 0;
+    nr_samples = 0;
+  }
+  // Backed off to 1Hz or suspended, nothing else reads the fast files.
+  // One sample per tick keeps the fast rates over the real elapsed time.
+  if (SampleInterval() >= 1000 || Suspended())
+    Sample();
+  // Widgets that sit still are only sampled every few ticks, their files
+  // are not even read in between.
+  for (auto w: widgets) {
+    w->due = w->countdown <= 0;
+    if (!w->due) w->countdown--;
+  }
+  for (auto &f: file_owners) {
+    auto &o = f.second;
+    bool due = std::any_of(o.widgets.begin(), o.widgets.end(), [](Widget *w) { return w->due; });
+    if (o.paused == !due) continue;
+    o.paused = !due;
+    sampler.Pause(f.first, o.paused);
+  }
+  sampler.Sample();
+  sampler.ReadCosts([this](const std::string &path, uint64_t ns) {
+      auto it = file_owners.find(path);
+      if (it == file_owners.end()) return;
+      auto &o = it->second.widgets;
+      for (auto w: o) w->sample_cost += ns / o.size();
+    });
+  for (auto &f: per_second_funcs) {
+    auto w = f.first;
+    if (w && !w->due) continue;
+    auto start = NowNanos();
+    f.second();
+    if (w) w->sample_cost += NowNanos() - start;
+  }
+  for (auto w: widgets) {
+    if (w->due) Reschedule(w);
+  }
+  EvaluateRules();
   Refresh();
 }
 
+// Doubles the interval while nothing moved, up to g_max_interval. Samples
+// cheaper than kCheapSample are not worth skipping. Widgets with rules on
+// them stay at g_min_interval, a rate averaged over a long interval would
+// hide the burst the rule is there for.
+void Bar::Reschedule(Widget *w)
+{
+  w->last_cost = w->sample_cost;
+  w->sample_cost = 0;
+  if (!w->Adaptive())
+    return;
+  auto digest = w->Digest();
+  bool watched = std::any_of(rules.begin(), rules.end(),
+                             [w](const AlertRule &r) { return r.widget == w; });
+  if (digest == w->digest && !watched && w->last_cost >= kCheapSample) {
+    w->interval = std::min(w->interval * 2, g_max_interval);
+  } else {
+    w->interval = g_min_interval;
+  }
+  w->digest = digest;
+  w->countdown = w->interval - 1;
+}
+
 void Bar::Refresh()
 {
+  if (Suspended())
+    return;
   for (auto w: widgets) {
     w->Refresh();
   }
+  // A new layout only costs drawing the static layers again.
+  if (layout_dirty)
+    Layout();
   for (auto ctx: ctxs) {
-    XClearWindow(dpy, ctx->win);
+    if (screensaver_on || dpms_off || !ctx->visible || ctx->covered)
+      continue;
+    if (ctx->layer_dirty) {
+      ctx->BeginLayer();
+      for (auto w: widgets) {
+        ctx->alert = w->nr_alerts > 0;
+        ctx->ResetColor();
+        w->RenderStatic(ctx);
+      }
+      ctx->EndLayer();
+    }
+    ctx->CopyLayer();
     for (auto w: widgets) {
+      ctx->alert = w->nr_alerts > 0;
+      ctx->ResetColor();
       w->Render(ctx);
     }
+    ctx->alert = false;
+    ctx->ResetColor();
   }
 }
 
@@ -212,8 +636,36 @@ class MainLoop {
  private:
   void OpenFifo(struct pollfd *pfd);
   void OpenXDisplay(struct pollfd *pfd);
+
+  // RandR sends a burst of events when docking. Wait until things settle.
+  static const int kReconfigureDelay = 250;
+  // Tick while nothing is visible, rates stay right over the long interval.
+  static const int kSuspendedTick = 10000;
+  // DPMS has no events, so poll it every few ticks, and more often while
+  // the monitors are off so that waking up draws a fresh frame right away.
+  static const int kDPMSTicks = 5;
+  static const int kDPMSOffPoll = 500;
 };
 
+static int HandleXError(Display *dpy, XErrorEvent *err)
+{
+  // The active window we are watching can go away at any time.
+  if (err->error_code == BadWindow)
+    return 0;
+  char msg[256];
+  XGetErrorText(dpy, err->error_code, msg, sizeof(msg));
+  fprintf(stderr, "X error: %s, request %d\n", msg, err->request_code);
+  std::exit(-1);
+}
+
+static int MillisecondsSince(const struct timeval &last)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - last.tv_sec) * 1000
+      + (now.tv_usec - last.tv_usec) / 1000;
+}
+
 MainLoop::MainLoop()
 {
   char path[PATH_MAX];
@@ -242,13 +694,20 @@ void MainLoop::OpenXDisplay(struct pollfd *pfd)
   pfd->events = POLLIN;
 
   XRRSelectInput(dpy, XDefaultRootWindow(dpy), RRScreenChangeNotifyMask);
+  XSelectInput(dpy, XDefaultRootWindow(dpy), PropertyChangeMask);
+  XSetErrorHandler(HandleXError);
 }
 
 void MainLoop::Run(Bar *bar)
 {
-  struct pollfd fds[2];
+  // Ours first, then whatever widgets want watched.
+  static const int kNrFds = 4;
+  std::vector<struct pollfd> fds(kNrFds);
+  fds.insert(fds.end(), bar->WatchFds().begin(), bar->WatchFds().end());
   struct pollfd *cfd = &fds[0];
   struct pollfd *xfd = &fds[1];
+  struct pollfd *sfd = &fds[2];
+  struct pollfd *ffd = &fds[3];
 
   int err_base, xrr_base;
   if (!XRRQueryExtension(dpy, &xrr_base, &err_base)) {
@@ -257,50 +716,91 @@ void MainLoop::Run(Bar *bar)
 
   printf("xrr_event_base %d\n", xrr_base);
 
+  int ss_base = -1;
+  if (XScreenSaverQueryExtension(dpy, &ss_base, &err_base)) {
+    XScreenSaverSelectInput(dpy, XDefaultRootWindow(dpy), ScreenSaverNotifyMask);
+  } else {
+    ss_base = -1;
+  }
+
   char command[PATH_MAX];
-  int timeout = 1000;
-  struct timeval last;
+  struct timeval last, last_sample, last_dpms, reconfigure_since;
+  bool reconfigure = false;
+  int ticks = 0;
   gettimeofday(&last, NULL);
+  last_sample = last_dpms = last;
 
   OpenFifo(cfd);
   OpenXDisplay(xfd);
 
+  bar->UpdateFullscreen();
+  bar->UpdateDPMS();
   bar->Refresh();
 
   while (true) {
     XFlush(dpy);
-    int ret = poll(fds, 2, timeout);
+    bool suspended = bar->Suspended();
+    int tick = suspended ? kSuspendedTick : 1000;
+    bar->SetTick(tick);
+    sfd->fd = bar->RemoteFd(false);
+    ffd->fd = bar->RemoteFd(true);
+    sfd->events = ffd->events = POLLIN;
+    // The collector paces us, the timer only covers for a stalled one.
+    int deadline = sfd->fd >= 0 ? 2 * tick : tick;
+    int timeout = std::max(0, deadline - MillisecondsSince(last));
+    if (!suspended && bar->SampleInterval() < 1000 && ffd->fd < 0) {
+      timeout = std::min(
+          timeout, std::max(0, bar->SampleInterval() - MillisecondsSince(last_sample)));
+    }
+    if (bar->DPMSOff()) {
+      timeout = std::min(
+          timeout, std::max(0, kDPMSOffPoll - MillisecondsSince(last_dpms)));
+    }
+    if (reconfigure) {
+      timeout = std::min(
+          timeout, std::max(0, kReconfigureDelay - MillisecondsSince(reconfigure_since)));
+    }
+    // Round trips since the last drain may have read events into Xlib's
+    // queue, the fd will not wake us for those.
+    bool queued = XEventsQueued(dpy, QueuedAlready) > 0;
+    if (queued)
+      timeout = 0;
+    int ret = poll(fds.data(), fds.size(), timeout);
     if (ret < 0) {
       if (errno == EINTR) continue;
       perror("poll");
       std::abort();
     }
 
-    if (ret == 0) {
-      bar->RefreshPerSecond();
-      gettimeofday(&last, NULL);
-      timeout = 1000;
-      continue;
-    }
+    bool need_refresh = false;
 
-    if (xfd->revents & POLLIN) {
-      while (XPending(dpy)) {
+    if (queued || (ret > 0 && (xfd->revents & POLLIN))) {
+      // We flush right before poll(), so don't let XPending() flush again.
+      while (XEventsQueued(dpy, QueuedAfterReading)) {
         XEvent evt;
         XNextEvent(dpy, &evt);
         if (evt.type == xrr_base + RRScreenChangeNotify) {
-          bar->Configure();
+          reconfigure = true;
+          gettimeofday(&reconfigure_since, NULL);
         } else if (evt.type == Expose) {
-          bar->Refresh();
+          need_refresh = true;
+        } else if (evt.type == VisibilityNotify) {
+          bar->OnVisibility(evt.xvisibility);
+        } else if (evt.type == PropertyNotify) {
+          bar->OnProperty(evt.xproperty);
+        } else if (ss_base >= 0 && evt.type == ss_base + ScreenSaverNotify) {
+          auto ss = (XScreenSaverNotifyEvent *) &evt;
+          bar->OnScreenSaver(ss->state != ScreenSaverOff);
         }
       }
     }
 
-    if (xfd->revents & POLLHUP) {
+    if (ret > 0 && (xfd->revents & POLLHUP)) {
       // Exiting the entire program
       return;
     }
 
-    if (cfd->revents & POLLIN) {
+    if (ret > 0 && (cfd->revents & POLLIN)) {
       char *p = command;
       int len = PATH_MAX;
       memset(command, 0, PATH_MAX);
@@ -321,42 +821,87 @@ void MainLoop::Run(Bar *bar)
       if (len > 0 && command[len - 1] == '\n') command[len - 1] = 0;
 
       bar->Execute(std::string(command));
-
-      struct timeval now;
-      int passed;
-      gettimeofday(&now, NULL);
-      passed = (now.tv_sec - last.tv_sec) * 1000
-               + (now.tv_usec - last.tv_usec) / 1000;
-      if (passed >= 1000) {
-        bar->RefreshPerSecond();
-        last = now;
-        timeout = 2000 - passed;
-      } else {
-        bar->Refresh();
-        timeout = 1000 - passed;
-      }
+      need_refresh = true;
     }
 
-    if (cfd->revents & POLLHUP) {
+    if (ret > 0 && (cfd->revents & POLLHUP)) {
       close(cfd->fd);
       OpenFifo(cfd);
     }
+
+    for (size_t i = kNrFds; ret > 0 && i < fds.size(); i++) {
+      if (fds[i].revents & (fds[i].events | POLLERR)) {
+        bar->OnWatch(i - kNrFds);
+        need_refresh = true;
+      }
+    }
+
+    if (reconfigure && MillisecondsSince(reconfigure_since) >= kReconfigureDelay) {
+      reconfigure = false;
+      bar->Configure();
+      bar->UpdateFullscreen();
+      need_refresh = true;
+    }
+
+    bool snapshot = false;
+    if (ret > 0 && sfd->fd >= 0 && (sfd->revents & (POLLIN | POLLHUP))) {
+      snapshot = bar->ReceiveSnapshot(false);
+    }
+    bool fast_snapshot = false;
+    if (ret > 0 && ffd->fd >= 0 && (ffd->revents & (POLLIN | POLLHUP))) {
+      fast_snapshot = bar->ReceiveSnapshot(true);
+    }
+
+    if (!suspended && bar->SampleInterval() < 1000
+        && (fast_snapshot
+            || (ffd->fd < 0 && MillisecondsSince(last_sample) >= bar->SampleInterval()))) {
+      bar->Sample();
+      gettimeofday(&last_sample, NULL);
+    }
+
+    bool due = snapshot || MillisecondsSince(last) >= deadline;
+    if ((due && (suspended || ++ticks % kDPMSTicks == 0))
+        || (bar->DPMSOff() && MillisecondsSince(last_dpms) >= kDPMSOffPoll)) {
+      bar->UpdateDPMS();
+      gettimeofday(&last_dpms, NULL);
+    }
+
+    // Coming back: draw a fresh frame right away instead of at the next tick.
+    if (due || (suspended && !bar->Suspended())) {
+      bar->RefreshPerSecond();
+      gettimeofday(&last, NULL);
+      last_sample = last;
+    } else if (need_refresh) {
+      bar->Refresh();
+    }
   }
 }
 
-
 bool Bar::g_all_screens = false;
 bool Bar::g_screen_top = true;
 int Bar::g_height = 16;
+int Bar::g_sample_hz = 1;
+bool Bar::g_show_p95 = false;
+std::vector<std::string> Bar::g_rules;
+std::string Bar::g_alert_fifo;
+int Bar::g_min_interval = 1;
+int Bar::g_max_interval = 16;
 
 }
 
+// render_test.cc brings its own.
+#ifndef SYSMON_TEST
+
 using namespace sysmon;
 
 int main(int argc, char *argv[])
 {
   int opt;
-  while ((opt = getopt(argc, argv, "ab")) != -1) {
+  std::string collector_path;
+  // Widgets beyond the default set, too wide to always be on: -w cgroup,
+  // hwmon, activity, runqueue, fs or tcp.
+  std::vector<std::string> extra;
+  while ((opt = getopt(argc, argv, "abur:pc:C:A:O:S:s:f:i:I:w:")) != -1) {
     switch(opt) {
       case 'a':
         Bar::g_all_screens = true;
@@ -364,12 +909,68 @@ int main(int argc, char *argv[])
       case 'b':
         Bar::g_screen_top = false;
         break;
+      case 'u':
+        Sampler::g_use_uring = true;
+        break;
+      case 'r':
+        Bar::g_sample_hz = std::min(100, std::max(1, std::atoi(optarg)));
+        break;
+      case 'p':
+        Bar::g_show_p95 = true;
+        break;
+      case 'c':
+        WidgetConfig::g_cgroups.push_back(optarg);
+        break;
+      case 'C':
+        WidgetConfig::g_cgroup_parent = optarg;
+        break;
+      case 'w':
+        extra.push_back(optarg);
+        break;
+      case 'f':
+        WidgetConfig::g_mounts.push_back(optarg);
+        break;
+      case 'i':
+        Bar::g_min_interval = std::max(1, std::atoi(optarg));
+        break;
+      case 'I':
+        Bar::g_max_interval = std::max(1, std::atoi(optarg));
+        break;
+      case 'A':
+        Bar::g_rules.push_back(optarg);
+        break;
+      case 'O':
+        Bar::g_alert_fifo = optarg;
+        break;
+      case 'S':
+        collector_path = optarg;
+        break;
+      case 's':
+        Sampler::g_remote = optarg;
+        break;
       default:
         std::exit(-1);
         break;
     }
   }
 
+  Bar::g_max_interval = std::max(Bar::g_min_interval, Bar::g_max_interval);
+  auto wants = [&](const char *name) {
+    return std::find(extra.begin(), extra.end(), name) != extra.end();
+  };
+
+  if (!collector_path.empty()) {
+    // Files are opened with our credentials on behalf of any local user,
+    // and some procfs files show root more than others (kallsyms).
+    if (geteuid() == 0) {
+      fprintf(stderr, "the collector does not run as root\n");
+      std::exit(-1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    Collector(collector_path).Run();
+    return 0;
+  }
+
   {
     std::stringstream ss;
     ss << getenv("HOME") << "/.sys-monitor.pid";
@@ -388,18 +989,38 @@ int main(int argc, char *argv[])
     }
   }
   Bar *bar = new Bar(_.display());
+  // Map the windows before any widget is constructed, they fill in as they
+  // become ready.
+  bar->Configure();
+  XFlush(_.display());
 
   bar->Add(Factory<Widget, CpuKind>::Construct(), AlignmentType::Left);
+  bar->Add(Factory<Widget, CpufreqKind>::Construct(), AlignmentType::Left);
+  if (wants("cgroup") || !WidgetConfig::g_cgroups.empty() || !WidgetConfig::g_cgroup_parent.empty())
+    bar->Add(Factory<Widget, CgroupKind>::Construct(), AlignmentType::Left);
+  if (wants("activity"))
+    bar->Add(Factory<Widget, ActivityKind>::Construct(), AlignmentType::Left);
+  if (wants("runqueue"))
+    bar->Add(Factory<Widget, RunqueueKind>::Construct(), AlignmentType::Left);
   bar->Add(Factory<Widget, TimeKind>::Construct(), AlignmentType::Right);
   bar->Add(Factory<Widget, VolumeKind>::Construct(), AlignmentType::Right);
   bar->Add(Factory<Widget, BacklightKind>::Construct(), AlignmentType::Right);
   bar->Add(Factory<Widget, MemoryKind>::Construct(), AlignmentType::Right);
+  if (wants("hwmon"))
+    bar->Add(Factory<Widget, HwmonKind>::Construct(), AlignmentType::Right);
   bar->Add(Factory<Widget, BatteryKind>::Construct(), AlignmentType::Right);
   bar->Add(Factory<Widget, NetworkKind>::Construct(), AlignmentType::Right);
+  if (wants("tcp"))
+    bar->Add(Factory<Widget, TcpKind>::Construct(), AlignmentType::Right);
   bar->Add(Factory<Widget, StorageKind>::Construct(), AlignmentType::Right);
-  bar->Configure();
+  if (wants("fs") || !WidgetConfig::g_mounts.empty())
+    bar->Add(Factory<Widget, FilesystemKind>::Construct(), AlignmentType::Right);
+  bar->CompileRules();
 
+  signal(SIGPIPE, SIG_IGN);
   _.Run(bar);
 
   return 0;
 }
+
+#endif
@@ -10,12 +10,24 @@
 #include <map>
 #include <functional>
 #include <cstdio>
+#include <ctime>
+
+#include <poll.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
+#include "sampler.h"
+
 namespace sysmon {
 
+inline uint64_t NowNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 // Abstract factory stuff copied from my old project
 
 template <typename T, typename ...Args>
@@ -66,6 +78,21 @@ enum WidgetKind : int {
   VolumeKind,
   TimeKind,
   BatteryKind,
+  HwmonKind,
+  CpufreqKind,
+  CgroupKind,
+  ActivityKind,
+  RunqueueKind,
+  FilesystemKind,
+  TcpKind,
+  NrWidgetKinds,
+};
+
+// Command line settings for widgets that need more than on/off.
+struct WidgetConfig {
+  static std::vector<std::string> g_cgroups;
+  static std::string g_cgroup_parent;
+  static std::vector<std::string> g_mounts;
 };
 
 class Widget;
@@ -77,25 +104,51 @@ class RenderContext {
   XftDraw *draw;
   XftColor color;
   ulong window_length;
+  XID crtc;
+  int x, y;
+  bool visible = true;
+  bool covered = false; // by a fullscreen window
+  bool alert = false; // the widget being drawn has a rule firing
+  // What Widget::RenderStatic() drew, every frame starts as a copy of it.
+  Pixmap layer = None;
+  ulong layer_length = 0;
+  bool layer_dirty = true;
+  Drawable target; // win, or layer while it is being drawn
+  GC gc;
   friend class Bar;
   RenderContext(Display *dpy, XftFont *font, Window win, ulong window_length)
       : dpy(dpy), font(font), win(win),
         draw(XftDrawCreate(dpy, win, XDefaultVisual(dpy, 0), XDefaultColormap(dpy, 0))),
-        window_length(window_length) {
+        window_length(window_length), crtc(None), x(0), y(0), target(win) {
+    XGCValues values;
+    values.foreground = 0; // the window background
+    values.graphics_exposures = 0;
+    gc = XCreateGC(dpy, win, GCForeground | GCGraphicsExposures, &values);
     ResetColor();
   }
   ~RenderContext() {
     XftDrawDestroy(draw);
+    if (layer != None) XFreePixmap(dpy, layer);
+    XFreeGC(dpy, gc);
   }
+  void BeginLayer();
+  void EndLayer();
+  void CopyLayer();
  public:
   static double g_dpi_scale;
   long Translate(Widget *, long offset);
-  RenderContext *DrawText(Widget *, std::string str, long offset = 0);
+  // In the same unscaled units as the offsets.
+  long TextWidth(const char *str, size_t len);
+  RenderContext *DrawText(Widget *, const char *str, size_t len, long offset = 0);
   RenderContext *DrawBlock(Widget *, long offset, size_t length);
+  RenderContext *DrawColumn(Widget *, long offset, size_t width, double fill, double base = 0);
   RenderContext *DrawBitmap(Widget *, Pixmap bitmap, size_t width, size_t height, long offset = 0);
   RenderContext *ResetColor() {
     auto m = std::numeric_limits<ushort>::max();
-    SetColor(m / 255 * 253, m / 255 * 254, m / 255 * 254);
+    if (alert)
+      SetColor(m / 255 * 0xE0, m / 255 * 0x50, m / 255 * 0x50);
+    else
+      SetColor(m / 255 * 253, m / 255 * 254, m / 255 * 254);
     return this;
   }
   RenderContext *SetColor(ushort r, ushort g, ushort b) {
@@ -114,6 +167,8 @@ enum AlignmentType : int {
 struct Alignment {
   AlignmentType type;
   size_t pos;
+  size_t width; // as of the last layout
+  long px; // scaled start (Left) or end (Right) of the widget
 };
 
 class Bar;
@@ -122,42 +177,202 @@ class Widget {
   friend class Bar;
   friend class RenderContext;
   Alignment align;
+  int nr_alerts = 0;
+  Bar *bar = nullptr;
+  // Sampling schedule in ticks, see Bar::RefreshPerSecond().
+  int interval = 1, countdown = 0;
+  bool due = true;
+  uint64_t digest = 0;
+  uint64_t sample_cost = 0, last_cost = 0; // ns
+ protected:
+  // Call whenever Width() changes; the bar lays out again before the next
+  // frame.
+  void InvalidateLayout();
+  // Call whenever what RenderStatic() draws changes without a new layout.
+  void InvalidateStatic();
+  // Of text in the bar's font, for Width().
+  long TextWidth(const char *str, size_t len);
+  // For Digest(), folds v into h.
+  static uint64_t Mix(uint64_t h, uint64_t v) { return (h ^ v) * 0x100000001b3ULL; }
  public:
   virtual void OnAdd(Bar *bar) {}
   virtual void Refresh() = 0;
+  // Widgets that can tell whether what they show has moved are sampled less
+  // and less often while it stays put. Digest() must change with the values.
+  virtual bool Adaptive() { return false; }
+  virtual uint64_t Digest() { return 0; }
 
+  // Icons, labels and tracks: drawn once per layout into a cached layer,
+  // which Render() then only draws the changing parts on top of.
+  virtual void RenderStatic(RenderContext *ctx) {}
   virtual void Render(RenderContext *ctx) = 0;
   virtual size_t Width() = 0;
 };
 
+// Fires when a metric stays past limit for duration ticks, clears once it
+// is back past limit -/+ hysteresis.
+struct AlertRule {
+  const double *value;
+  Widget *widget;
+  double limit, clear;
+  bool above;
+  int duration, count;
+  bool firing;
+  std::string metric;
+};
+
 class Bar {
-  std::array<size_t, AlignmentType::AllTypes> pos;
   std::vector<Widget *> widgets;
-  std::vector<std::function<void ()>> per_second_funcs;
+  bool layout_dirty = true;
+  std::vector<std::pair<Widget *, std::function<void ()>>> per_second_funcs;
+  std::vector<std::function<void ()>> sample_funcs;
   std::map<std::string, std::function<void ()>> cmd_map;
+  // Who registered what, so that a widget's files and functions are skipped
+  // together while it is not due.
+  Widget *adding = nullptr;
+  struct FileOwners {
+    std::vector<Widget *> widgets;
+    bool paused = false;
+  };
+  std::map<std::string, FileOwners> file_owners;
+  std::map<std::string, Widget *> cmd_owners;
+  std::vector<struct pollfd> watch_fds;
+  std::vector<std::function<void ()>> watch_funcs;
+  Sampler sampler;
+  Sampler fast_sampler;
+  int sample_hz;
+  uint64_t sample_cost_sum = 0, sample_cost_max = 0;
+  int nr_samples = 0;
+  uint64_t last_cost_avg = 0, last_cost_max = 0;
   Display *dpy;
   XftFont *font;
   std::vector<RenderContext *> ctxs;
 
+  enum : int {
+    NetWmWindowTypeDockAtom,
+    NetWmWindowTypeAtom,
+    MotifWmHintsAtom,
+    NetWmStrutAtom,
+    NetActiveWindowAtom,
+    NetWmStateAtom,
+    NetWmStateFullscreenAtom,
+    NrAtoms,
+  };
+  Atom atoms[NrAtoms];
+
+  std::map<std::string, std::pair<double, Widget *>> metrics;
+  std::vector<AlertRule> rules;
+  std::vector<std::string> pending_rules; // on metrics not registered yet
+  bool rules_compiled = false;
+  int alert_fd = -1;
+
+  void Alert(const AlertRule &rule, double value);
+
+  bool has_dpms;
+  bool screensaver_on = false;
+  bool dpms_off = false;
+  Window active_win = None;
+
   Window CreateWindow(int x, int y, int width, int height);
+  static const uint64_t kCheapSample = 5000; // ns
+  void Reschedule(Widget *w);
 
  public:
   static bool g_all_screens;
   static bool g_screen_top;
   static int g_height;
+  static int g_sample_hz;
+  static bool g_show_p95;
+  static std::vector<std::string> g_rules;
+  static std::string g_alert_fifo;
+  static int g_min_interval;
+  static int g_max_interval;
   Bar(Display *dpy);
   void Configure();
   void Add(Widget *widget, AlignmentType type);
+  void InvalidateLayout() { layout_dirty = true; }
+  void InvalidateStatic() {
+    for (auto ctx: ctxs) ctx->layer_dirty = true;
+  }
+  long TextWidth(const char *str, size_t len);
+  void Layout();
 
   void RegisterPerSecondRefresh(std::function<void ()> func) {
-    per_second_funcs.push_back(func);
+    per_second_funcs.push_back(std::make_pair(adding, func));
   }
   void RegisterCommand(std::string cmd, std::function<void ()> func) {
     cmd_map[cmd] = func;
+    if (adding) cmd_owners[cmd] = adding;
+  }
+  // The main loop polls fd for events along with the X connection and calls
+  // func when any of them, or an error, is pending. Must be registered
+  // before MainLoop::Run().
+  void RegisterWatch(int fd, short events, std::function<void ()> func) {
+    watch_fds.push_back(pollfd{fd, events, 0});
+    watch_funcs.push_back(func);
+  }
+  const std::vector<struct pollfd> &WatchFds() const { return watch_fds; }
+  void OnWatch(size_t i) { watch_funcs[i](); }
+  // The parser runs with the file's contents every second, right before the
+  // per second refresh functions.
+  // Files marked fast are read at the sample rate instead.
+  bool RegisterSampledFile(std::string path, Sampler::Parser parser, size_t size = 4096,
+                           bool fast = false) {
+    if (fast && g_sample_hz > 1)
+      return fast_sampler.Register(path, parser, size);
+    auto owner = adding;
+    if (owner)
+      file_owners[path].widgets.push_back(owner);
+    return sampler.Register(path, [owner, parser](const char *buf, size_t len) {
+        auto start = NowNanos();
+        parser(buf, len);
+        if (owner) owner->sample_cost += NowNanos() - start;
+      }, size);
+  }
+  // Called sample_hz times per second, between repaints.
+  void RegisterSample(std::function<void ()> func) {
+    sample_funcs.push_back(func);
+  }
+  int SampleInterval() const { return 1000 / sample_hz; }
+  // With a collector (-s), snapshots arrive on its socket every tick ms and
+  // drive sampling instead of our timers.
+  void SetTick(int tick) {
+    sampler.SetInterval(tick);
+    fast_sampler.SetInterval(SampleInterval());
   }
+  int RemoteFd(bool fast) const {
+    return fast ? fast_sampler.RemoteFd() : sampler.RemoteFd();
+  }
+  bool ReceiveSnapshot(bool fast) {
+    return fast ? fast_sampler.Receive() : sampler.Receive();
+  }
+
+  // A value widgets keep up to date after each sample, for alert rules to
+  // refer to by name.
+  // Metrics may also come later, rules waiting for them are compiled then.
+  double *RegisterMetric(Widget *widget, std::string name) {
+    auto &m = metrics[name];
+    m.second = widget;
+    if (rules_compiled && !pending_rules.empty())
+      CompileRules();
+    return &m.first;
+  }
+  // Resolves g_rules against the registered metrics, once all widgets are in.
+  void CompileRules();
+  void EvaluateRules();
 
   Pixmap LoadBitmap(const uint8_t* data, unsigned int width, unsigned int height);
 
+  // Nothing of the bar can be seen, so there is no point in drawing.
+  bool Suspended();
+  void OnVisibility(const XVisibilityEvent &evt);
+  void OnProperty(const XPropertyEvent &evt);
+  void OnScreenSaver(bool on) { screensaver_on = on; }
+  void UpdateFullscreen();
+  void UpdateDPMS();
+  bool DPMSOff() const { return dpms_off; }
+
+  void Sample();
   void RefreshPerSecond();
   void Refresh();
   void Execute(std::string cmd) {
@@ -165,6 +380,15 @@ class Bar {
     if ((it = cmd_map.find(cmd)) != cmd_map.end()) {
       it->second();
     }
+    // The user just touched it, expect changes.
+    auto owner = cmd_owners.find(cmd);
+    if (owner != cmd_owners.end())
+      Wake(owner->second);
+  }
+  // Back to sampling the widget every g_min_interval, starting next tick.
+  void Wake(Widget *w) {
+    w->interval = g_min_interval;
+    w->countdown = 0;
   }
 };
 
@@ -0,0 +1,90 @@
+// Draws frames with every widget on the bar and fails if any of them
+// allocates once things are warmed up. Needs an X display, Xvfb will do.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "monitor.h"
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+// Only the drawing thread counts, widgets may have workers of their own.
+static __thread bool g_counting = false;
+static size_t g_allocs = 0;
+
+extern "C" __attribute__((externally_visible)) void *malloc(size_t size)
+{
+  if (g_counting) g_allocs++;
+  return __libc_malloc(size);
+}
+
+extern "C" __attribute__((externally_visible)) void *calloc(size_t n, size_t size)
+{
+  if (g_counting) g_allocs++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" __attribute__((externally_visible)) void *realloc(void *ptr, size_t size)
+{
+  if (g_counting) g_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+using namespace sysmon;
+
+static const int kWarmupTicks = 5;
+static const int kFrames = 100;
+
+int main()
+{
+  Display *dpy = XOpenDisplay(nullptr);
+  if (dpy == nullptr) {
+    puts("render_test: no display, skipped");
+    return 0;
+  }
+
+  Bar *bar = new Bar(dpy);
+  bar->Configure();
+  Factory<Widget, NrWidgetKinds>::Initialize();
+  for (int k = 0; k < NrWidgetKinds; k++) {
+    bar->Add(Factory<Widget, NrWidgetKinds>::Create(k),
+             k % 2 ? AlignmentType::Right : AlignmentType::Left);
+  }
+  bar->CompileRules();
+
+  // Xft loads glyphs on first use. Fonts are shared by pattern, so this
+  // loads them into the bar's font as well.
+  auto font = XftFontOpen(dpy, XDefaultScreen(dpy),
+                          XFT_FAMILY, XftTypeString, "Sans",
+                          XFT_SIZE, XftTypeDouble, 10.0,
+                          nullptr);
+  for (int c = 0x20; c < 0x7f; c++) {
+    FcChar8 ch = c;
+    XGlyphInfo ext;
+    XftTextExtents8(dpy, font, &ch, 1, &ext);
+  }
+  XGlyphInfo ext;
+  XftTextExtentsUtf8(dpy, font, (const FcChar8 *) "°", 2, &ext);
+
+  for (int i = 0; i < kWarmupTicks; i++) {
+    bar->RefreshPerSecond();
+    XSync(dpy, False);
+  }
+
+  size_t worst = 0, total = 0;
+  for (int i = 0; i < kFrames; i++) {
+    g_allocs = 0;
+    g_counting = true;
+    bar->Refresh();
+    g_counting = false;
+    XSync(dpy, False);
+    worst = std::max(worst, g_allocs);
+    total += g_allocs;
+  }
+  printf("render_test: %zu allocations in %d frames, at most %zu in one\n",
+         total, kFrames, worst);
+  return worst == 0 ? 0 : 1;
+}
@@ -0,0 +1,463 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <linux/io_uring.h>
+
+#include "sampler.h"
+#include "collector.h"
+#include "monitor.h"
+
+namespace sysmon {
+
+bool Sampler::g_use_uring = false;
+std::string Sampler::g_remote;
+
+struct Sampler::Ring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+Sampler::Sampler()
+{
+  if (g_use_uring && !SetupRing()) {
+    fputs("io_uring not available, sampling synchronously\n", stderr);
+  }
+}
+
+Sampler::~Sampler()
+{
+  DestroyRing();
+  Disconnect();
+  for (auto &f: files) {
+    close(f.fd);
+  }
+}
+
+bool Sampler::SetupRing()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, 64, &p);
+  if (fd < 0)
+    return false;
+
+  ring = new Ring();
+  ring->fd = fd;
+  ring->entries = p.sq_entries;
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    ring->sq_map_len = ring->cq_map_len = std::max(ring->sq_map_len, ring->cq_map_len);
+  }
+
+  ring->sq_map = mmap(nullptr, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_map = single ? ring->sq_map
+                 : mmap(nullptr, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes = (struct io_uring_sqe *) mmap(
+      nullptr, ring->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED
+      || ring->sqes == MAP_FAILED) {
+    DestroyRing();
+    return false;
+  }
+
+  auto sq = (char *) ring->sq_map;
+  auto cq = (char *) ring->cq_map;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return true;
+}
+
+void Sampler::DestroyRing()
+{
+  if (ring == nullptr)
+    return;
+  if (ring->sqes != nullptr && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map != nullptr && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_len);
+  if (ring->sq_map != nullptr && ring->sq_map != MAP_FAILED)
+    munmap(ring->sq_map, ring->sq_map_len);
+  close(ring->fd);
+  delete ring;
+  ring = nullptr;
+}
+
+// Fixed files and one registered buffer covering the whole arena, so the
+// kernel does not have to look up fds or pin pages on every read.
+bool Sampler::RegisterRing()
+{
+  syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+  syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_FILES, nullptr, 0);
+
+  std::vector<int> fds;
+  for (auto &f: files) {
+    fds.push_back(f.fd);
+  }
+  struct iovec iov = { arena.data(), arena.size() };
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES,
+              fds.data(), fds.size()) < 0
+      || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                 &iov, 1) < 0) {
+    perror("io_uring_register");
+    return false;
+  }
+  dirty = false;
+  return true;
+}
+
+bool Sampler::SubmitRing()
+{
+  auto start = NowNanos();
+  std::vector<size_t> retry, active;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (!files[i].paused)
+      active.push_back(i);
+  }
+  size_t n = active.size(), submitted = 0;
+
+  while (submitted < n) {
+    unsigned tail = *ring->sq_tail;
+    unsigned batch = 0;
+    for (; submitted < n && batch < ring->entries; submitted++, batch++) {
+      auto i = active[submitted];
+      auto &f = files[i];
+      unsigned idx = tail & *ring->sq_mask;
+      auto sqe = &ring->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->flags = IOSQE_FIXED_FILE;
+      sqe->fd = i;
+      sqe->addr = (uintptr_t) &arena[f.offset];
+      sqe->len = f.size;
+      sqe->off = 0;
+      sqe->buf_index = 0;
+      sqe->user_data = i;
+      ring->sq_array[idx] = idx;
+      tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = batch, reaped = 0;
+    while (reaped < batch) {
+      int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, batch - reaped,
+                        IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        perror("io_uring_enter");
+        return false;
+      }
+      to_submit -= std::min<unsigned>(to_submit, ret);
+
+      unsigned head = *ring->cq_head;
+      unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++, reaped++) {
+        auto cqe = &ring->cqes[head & *ring->cq_mask];
+        auto &f = files[cqe->user_data];
+        if (cqe->res < 0 || (size_t) cqe->res * 2 > f.size) {
+          // Failed, or the file may have outgrown its buffer.
+          retry.push_back(cqe->user_data);
+          continue;
+        }
+        f.len = cqe->res;
+        arena[f.offset + f.len] = 0;
+      }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  auto share = n > 0 ? (NowNanos() - start) / n : 0;
+  for (auto i: active) {
+    files[i].cost = share;
+  }
+  for (auto i: retry) {
+    ReadSync(files[i]);
+  }
+  return true;
+}
+
+void Sampler::Grow(File &f)
+{
+  Repack(&f);
+}
+
+// Keep the contents of every file, only the buffer of grow gets bigger.
+void Sampler::Repack(const File *grow)
+{
+  std::vector<char> new_arena;
+  for (auto &g: files) {
+    size_t size = &g == grow ? g.size * 2 : g.size;
+    size_t offset = new_arena.size();
+    new_arena.resize(offset + size + 1);
+    memcpy(&new_arena[offset], &arena[g.offset], g.len + 1);
+    g.offset = offset;
+    g.size = size;
+  }
+  arena.swap(new_arena);
+  dirty = true;
+}
+
+// A short read from a seq_file only means EOF if the next record would have
+// fit, so keep buffers at least twice as large as the contents.
+bool Sampler::ReadSync(File &f)
+{
+  auto start = NowNanos();
+  f.len = 0;
+  while (true) {
+    ssize_t rs = pread(f.fd, &arena[f.offset + f.len], f.size - f.len, f.len);
+    if (rs < 0) {
+      if (errno == EINTR) continue;
+      f.len = 0;
+      arena[f.offset] = 0;
+      f.cost = NowNanos() - start;
+      return false;
+    }
+    f.len += rs;
+    arena[f.offset + f.len] = 0;
+    if (rs == 0 || f.len * 2 <= f.size)
+      break;
+    if (f.len == f.size)
+      Grow(f);
+  }
+  if (f.len * 2 > f.size)
+    Grow(f);
+  f.cost = NowNanos() - start;
+  return true;
+}
+
+bool Sampler::Register(std::string path, Parser parser, size_t size)
+{
+  // Several widgets may parse the same file, read it once for all of them.
+  for (auto &f: files) {
+    if (f.path != path)
+      continue;
+    auto prev = f.parser;
+    f.parser = [prev, parser](const char *buf, size_t len) {
+      prev(buf, len);
+      parser(buf, len);
+    };
+    return true;
+  }
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  size_t offset = arena.size();
+  arena.resize(offset + size + 1);
+  arena[offset] = 0;
+  files.push_back(File{path, fd, offset, size, 0, parser, false, 0});
+  dirty = true;
+  subscribed = false;
+  return true;
+}
+
+void Sampler::Unregister(const std::string &path)
+{
+  auto it = std::find_if(files.begin(), files.end(),
+                         [&](const File &f) { return f.path == path; });
+  if (it == files.end())
+    return;
+  close(it->fd);
+  files.erase(it);
+  Repack(nullptr);
+  subscribed = false;
+}
+
+void Sampler::Sample()
+{
+  if (files.empty())
+    return;
+  if (!g_remote.empty() && (subscribed || Subscribe()) && has_snapshot) {
+    for (auto &f: files) {
+      if (f.len > 0 && !f.paused)
+        f.parser(&arena[f.offset], f.len);
+    }
+    return;
+  }
+  if (ring && dirty && !RegisterRing()) {
+    DestroyRing();
+  }
+  if (!ring || !SubmitRing()) {
+    DestroyRing();
+    for (auto &f: files) {
+      if (!f.paused)
+        ReadSync(f);
+    }
+  }
+  for (auto &f: files) {
+    if (f.len > 0 && !f.paused)
+      f.parser(&arena[f.offset], f.len);
+  }
+}
+
+void Sampler::Pause(const std::string &path, bool paused)
+{
+  for (auto &f: files) {
+    if (f.path == path)
+      f.paused = paused;
+  }
+}
+
+void Sampler::ReadCosts(std::function<void (const std::string &path, uint64_t ns)> func) const
+{
+  for (auto &f: files) {
+    func(f.path, f.paused ? 0 : f.cost);
+  }
+}
+
+bool Sampler::ReadOnce(std::string path, Parser parser)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  std::vector<char> buf(4096);
+  size_t len = 0;
+  while (true) {
+    ssize_t rs = read(fd, &buf[len], buf.size() - len - 1);
+    if (rs < 0 && errno == EINTR) continue;
+    if (rs <= 0) break;
+    len += rs;
+    if (len == buf.size() - 1)
+      buf.resize(buf.size() * 2);
+  }
+  close(fd);
+  buf[len] = 0;
+  if (len > 0)
+    parser(buf.data(), len);
+  return len > 0;
+}
+
+bool Sampler::Connect()
+{
+  remote_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (remote_fd < 0)
+    return false;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, g_remote.c_str(), sizeof(addr.sun_path) - 1);
+  if (connect(remote_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    Disconnect();
+    return false;
+  }
+  rbuf.resize(Collector::kMaxMessage);
+  return true;
+}
+
+void Sampler::Disconnect()
+{
+  if (remote_fd >= 0)
+    close(remote_fd);
+  remote_fd = -1;
+  subscribed = false;
+  has_snapshot = false;
+}
+
+// Sent again whenever the file list or the interval changes.
+bool Sampler::Subscribe()
+{
+  if (remote_fd < 0 && !Connect())
+    return false;
+  std::string msg;
+  Collector::Append(msg, (uint32_t) interval);
+  Collector::Append(msg, (uint32_t) files.size());
+  for (auto &f: files) {
+    Collector::Append(msg, (uint32_t) f.path.length());
+    msg += f.path;
+  }
+  if (send(remote_fd, msg.data(), msg.length(), MSG_NOSIGNAL) < 0) {
+    Disconnect();
+    return false;
+  }
+  subscribed = true;
+  return true;
+}
+
+void Sampler::SetInterval(int ms)
+{
+  if (ms == interval)
+    return;
+  interval = ms;
+  subscribed = false;
+  if (remote_fd >= 0)
+    Subscribe();
+}
+
+bool Sampler::Receive()
+{
+  bool done = false;
+  while (remote_fd >= 0) {
+    ssize_t rs = recv(remote_fd, rbuf.data(), rbuf.size(), MSG_DONTWAIT);
+    if (rs < 0 && errno == EINTR) continue;
+    if (rs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (rs <= 0) {
+      // The collector went away, sample locally until it is back.
+      Disconnect();
+      break;
+    }
+    const char *p = rbuf.data(), *end = p + rs;
+    uint32_t idx, off, total;
+    if (!Collector::Fetch(p, end, idx) || !Collector::Fetch(p, end, off)
+        || !Collector::Fetch(p, end, total))
+      continue;
+    if (idx == Collector::kEndOfSnapshot) {
+      has_snapshot = done = true;
+      continue;
+    }
+    size_t n = end - p;
+    if (idx >= files.size() || off + n > total)
+      continue;
+    if (off > 0 || n < total) {
+      // Chunks come in order, a gap means the rest of that version was
+      // dropped and a new one starts over at 0.
+      if (off == 0) {
+        partial.clear();
+        partial_idx = idx;
+      } else if (idx != partial_idx || off != partial.size()) {
+        partial.clear();
+        continue;
+      }
+      partial.insert(partial.end(), p, end);
+      if (partial.size() < total)
+        continue;
+      p = partial.data();
+    }
+    auto &f = files[idx];
+    while (total * 2 > f.size)
+      Grow(f);
+    memcpy(&arena[f.offset], p, total);
+    f.len = total;
+    arena[f.offset + total] = 0;
+    partial.clear();
+  }
+  return done;
+}
+
+}
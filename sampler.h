@@ -0,0 +1,86 @@
+// -*- mode: c++ -*-
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace sysmon {
+
+// Files that widgets read on every tick. They are kept open and read all in
+// one go: a single io_uring submission when available, pread() otherwise.
+class Sampler {
+ public:
+  typedef std::function<void (const char *buf, size_t len)> Parser;
+ private:
+  struct File {
+    std::string path;
+    int fd;
+    size_t offset; // into the arena
+    size_t size;
+    size_t len;
+    Parser parser;
+    bool paused;
+    uint64_t cost; // ns, of the last read
+  };
+  struct Ring;
+
+  std::vector<File> files;
+  std::vector<char> arena;
+  Ring *ring = nullptr;
+  bool dirty = true; // arena or files changed, need to register them again
+
+  bool SetupRing();
+  void DestroyRing();
+  bool RegisterRing();
+  bool SubmitRing();
+  bool ReadSync(File &f);
+  void Grow(File &f);
+  void Repack(const File *grow);
+
+  // Client side of the collector (collector.h). Snapshots arrive on our own
+  // schedule and only carry the files that changed.
+  int remote_fd = -1;
+  int interval = 1000;
+  bool subscribed = false;
+  bool has_snapshot = false;
+  std::vector<char> rbuf;
+  // A file that spans several chunks is only copied in once all of them
+  // arrived, so a snapshot cut short never leaves half of another version.
+  std::vector<char> partial;
+  uint32_t partial_idx = 0;
+  bool Connect();
+  void Disconnect();
+  bool Subscribe();
+ public:
+  static bool g_use_uring;
+  static std::string g_remote;
+
+  Sampler();
+  ~Sampler();
+
+  bool Register(std::string path, Parser parser, size_t size = 4096);
+  void Unregister(const std::string &path);
+  void Sample();
+  // Paused files are neither read nor parsed until resumed.
+  void Pause(const std::string &path, bool paused);
+  // What reading each file took on the last Sample(). A batch is shared
+  // evenly among its files.
+  void ReadCosts(std::function<void (const std::string &path, uint64_t ns)> func) const;
+
+  // How often the collector should send us snapshots.
+  void SetInterval(int ms);
+  int RemoteFd() const { return subscribed ? remote_fd : -1; }
+  // Drains the collector socket, true once a whole snapshot is in.
+  bool Receive();
+
+  // For constructors that need a value before the first tick.
+  static bool ReadOnce(std::string path, Parser parser);
+};
+
+}
+
+#endif
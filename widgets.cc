@@ -1,10 +1,27 @@
 #include <fstream>
 #include <iostream>
 #include <cstring>
+#include <cstdarg>
+#include <cstdio>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
 #include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 #include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <pulse/pulseaudio.h>
 
@@ -13,6 +30,21 @@
 
 namespace sysmon {
 
+// Render() runs every frame on every screen, so text is formatted into
+// buffers on the stack rather than into strings. Returns the length that fit.
+static size_t Format(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static size_t Format(char *buf, size_t size, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  if (n < 0) return 0;
+  return std::min<size_t>(n, size - 1);
+}
+
 class DeviceUtil {
  protected:
   bool IsPhysicalDevice(std::string device_class, std::string device_name) {
@@ -53,6 +85,22 @@ class DeviceUtil {
     return res;
   }
 
+  std::string StatPath(std::string device_class, std::string device_name, std::string node) {
+    return "/sys/class/" + device_class + "/" + device_name + "/" + node;
+  }
+  // For nodes read every tick: keep the fd open and pread() it instead.
+  int OpenStat(std::string device_class, std::string device_name, std::string node) {
+    return open(StatPath(device_class, device_name, node).c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  bool PreadValue(int fd, int64_t &value) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return false;
+    buf[n] = 0;
+    value = strtoll(buf, nullptr, 10);
+    return true;
+  }
+
   void WriteStat(std::string device_class, std::string device_name, std::string node, int64_t value) {
     std::stringstream path;
     path << "/sys/class/" << device_class << "/" << device_name << "/" << node;
@@ -101,47 +149,162 @@ class StringUtils {
       return false;
     return strncmp(str.c_str(), prefix.c_str(), prefix.length()) == 0;
   }
+
+  // The number after key in a "key value" style file, 0 if it is missing.
+  uint64_t FindValue(const char *buf, const char *key) {
+    auto p = strstr(buf, key);
+    if (!p) return 0;
+    return strtoull(p + strlen(key), nullptr, 10);
+  }
+
+  // Reads up to n space separated numbers, stopping at anything else. Files
+  // with a column per cpu run into hundreds of KB on big machines, so no
+  // strtoull() and no allocation.
+  static const char *ReadColumns(const char *p, uint64_t *out, size_t n, size_t &count) {
+    count = 0;
+    while (count < n) {
+      while (*p == ' ') p++;
+      if (*p < '0' || *p > '9') break;
+      uint64_t v = 0;
+      for (; *p >= '0' && *p <= '9'; p++) v = v * 10 + (*p - '0');
+      out[count++] = v;
+    }
+    return p;
+  }
 };
 
 class BaseRateWidget : public Widget {
   std::vector<uint64_t> sums;
+  uint64_t last_sample;
+  // For fast sampling: the previous sample and the rates seen since the
+  // last repaint, one window per counter.
+  std::vector<uint64_t> prev;
+  uint64_t prev_time;
+  std::vector<std::vector<int64_t>> windows;
  protected:
-  std::vector<int64_t> rates;
- public:
-  BaseRateWidget(std::vector<uint64_t> sums) : sums(sums) {
-    rates.resize(sums.size());
+  std::vector<int64_t> deltas;
+  std::vector<int64_t> rates; // per second of real elapsed time
+  std::vector<int64_t> peaks, p95s; // of the sub-second rates
+
+  // Subclasses call this once their own members are ready to Count().
+  void Reset() {
+    sums = prev = Count();
+    last_sample = prev_time = NowNanos();
+    deltas.assign(sums.size(), 0);
+    rates.assign(sums.size(), 0);
+    peaks.assign(sums.size(), 0);
+    p95s.assign(sums.size(), 0);
+    windows.assign(sums.size(), std::vector<int64_t>());
   }
 
+  // Rates that burst within a second are worth sampling faster.
+  virtual bool Bursty() { return false; }
+  bool Fast() { return Bursty() && Bar::g_sample_hz > 1; }
+
+  // avg, or avg/peak (avg/p95/peak) when sampling fast.
+  size_t FormatRate(char *buf, size_t size, int i, int64_t unit) {
+    size_t len = Format(buf, size, "%lld", (long long) (rates[i] / unit));
+    if (!Fast()) return len;
+    if (Bar::g_show_p95)
+      len += Format(buf + len, size - len, "/%lld", (long long) (p95s[i] / unit));
+    len += Format(buf + len, size - len, "/%lld", (long long) (peaks[i] / unit));
+    return len;
+  }
+  size_t RateWidth(size_t width) {
+    if (!Fast()) return width;
+    return width + (Bar::g_show_p95 ? 60 : 30);
+  }
+ public:
   virtual std::vector<uint64_t> Count() = 0;
 
   void Refresh() override {};
   void OnAdd(Bar *bar) override {
+    if (Fast()) {
+      bar->RegisterSample([=]() {
+          auto s = Count();
+          auto now = NowNanos();
+          auto elapsed = std::max<uint64_t>(1, now - prev_time);
+          if (s.size() != prev.size()) {
+            prev = s;
+            windows.assign(s.size(), std::vector<int64_t>());
+          }
+          for (int i = 0; i < s.size(); i++) {
+            windows[i].push_back((int64_t) (s[i] - prev[i]) * 1000000000LL / (int64_t) elapsed);
+          }
+          prev = s;
+          prev_time = now;
+        });
+    }
     bar->RegisterPerSecondRefresh([=]() {
         auto s = Count();
+        auto now = NowNanos();
+        auto elapsed = std::max<uint64_t>(1, now - last_sample);
+        // Counters may come and go with hotplug.
+        sums.resize(s.size());
+        deltas.resize(s.size());
+        rates.resize(s.size());
+        peaks.resize(s.size());
+        p95s.resize(s.size());
+        windows.resize(s.size());
         for (int i = 0; i < s.size(); i++) {
-          rates[i] = s[i] - sums[i];
+          deltas[i] = s[i] - sums[i];
+          rates[i] = deltas[i] * 1000000000LL / (int64_t) elapsed;
+          auto &w = windows[i];
+          if (w.empty()) {
+            peaks[i] = p95s[i] = rates[i];
+            continue;
+          }
+          auto p95 = w.begin() + (w.size() * 95 - 1) / 100;
+          std::nth_element(w.begin(), p95, w.end());
+          p95s[i] = *p95;
+          peaks[i] = *std::max_element(p95, w.end());
+          w.clear();
         }
         sums = s;
+        last_sample = now;
       });
   }
 };
 
 
 class CpuWidget : public BaseRateWidget, public StringUtils {
-  int nr_socks;
+  // Per cpu, aggregate first. user includes nice, irq includes softirq.
+  enum : int {
+    User, System, IOWait, IRQ, Steal, Idle, NrFields,
+  };
+  int nr_socks = 1;
   std::string model;
+  std::vector<uint64_t> counts;
   Pixmap cpu_icon;
+  // /proc/cpuinfo runs into megabytes on large hosts, so it is parsed a bit
+  // on every tick rather than before the bar shows up.
+  std::ifstream cpuinfo;
+  static const uint64_t kCpuinfoBudget = 2000000; // ns per tick
+  // Where the summary and the per-core columns start, as wide as the model
+  // name needs.
+  long summary_x = 16, columns_x = 220;
  public:
-  CpuWidget() : BaseRateWidget(Count()) {
-    std::ifstream fin("/proc/cpuinfo");
-    for (std::string line; std::getline(fin, line); ) {
+  CpuWidget() : cpuinfo("/proc/cpuinfo") {
+    Sampler::ReadOnce("/proc/stat", [=](const char *buf, size_t len) { ParseStat(buf, len); });
+    Reset();
+  }
+
+  void LoadCpuinfo() {
+    auto deadline = NowNanos() + kCpuinfoBudget;
+    std::string line;
+    for (int i = 0; std::getline(cpuinfo, line); i++) {
       auto arr = Split(line, ':');
-      if (arr.size() < 2) continue;
-      if (StartsWith(arr[0], "model name"))
-        set_model(arr[1]);
-      if (StartsWith(arr[0], "physical id"))
-        nr_socks = 1 + std::stoi(arr[1]);
+      if (arr.size() >= 2) {
+        if (StartsWith(arr[0], "model name"))
+          set_model(arr[1]);
+        if (StartsWith(arr[0], "physical id"))
+          nr_socks = std::max(nr_socks, 1 + std::stoi(arr[1]));
+      }
+      if (i % 64 == 63 && NowNanos() > deadline)
+        return;
     }
+    cpuinfo.close();
+    InvalidateLayout();
   }
 
   void set_model(std::string str) {
@@ -150,38 +313,132 @@ class CpuWidget : public BaseRateWidget, public StringUtils {
     model = Trim(str);
   }
 
-  std::vector<uint64_t> Count() override final {
-    std::ifstream fin("/proc/stat");
-    std::vector<uint64_t> cnts;
+  // The whole machine goes to slot 0 and cpuN to slot N + 1. Offline cpus
+  // are not listed, their slots keep the last counts so that the others do
+  // not shift and their deltas are 0.
+  void ParseStat(const char *buf, size_t len) {
+    std::istringstream fin(std::string(buf, len));
+    auto old_size = counts.size();
     for (std::string line; std::getline(fin, line); ) {
-      if (StartsWith(line, "cpu ")) continue; // skip the overall cpu
       if (!StartsWith(line, "cpu")) continue; // skip non-cpu line
       auto arr = Split(line, ' ');
-      size_t cnt = 0;
-      for (int i = 1; i < arr.size(); i++) {
-        if (i == 4) continue;
-        cnt += std::stoll(arr[i]);
+      size_t slot = arr[0].length() > 3 ? std::stoul(arr[0].substr(3)) + 1 : 0;
+      if (counts.size() < (slot + 1) * NrFields)
+        counts.resize((slot + 1) * NrFields, 0);
+      uint64_t f[8] = {};
+      for (int i = 1; i < arr.size() && i <= 8; i++) {
+        f[i - 1] = std::stoll(arr[i]);
       }
-      cnts.push_back(cnt);
+      // user nice system idle iowait irq softirq steal; guest time is
+      // already part of user.
+      auto c = counts.begin() + slot * NrFields;
+      c[User] = f[0] + f[1];
+      c[System] = f[2];
+      c[IOWait] = f[4];
+      c[IRQ] = f[5] + f[6];
+      c[Steal] = f[7];
+      c[Idle] = f[3];
     }
-    return cnts;
+    if (counts.size() != old_size) InvalidateLayout();
+  }
+
+  std::vector<uint64_t> Count() override final {
+    return counts;
+  }
+
+  int NrCpus() { return deltas.size() / NrFields - 1; }
+  int64_t Elapsed(int cpu) {
+    auto base = deltas.begin() + cpu * NrFields;
+    int64_t total = 0;
+    for (int i = 0; i < NrFields; i++) total += base[i];
+    return total;
+  }
+  // Nothing elapsed on the first tick, or for an offline cpu.
+  bool HasData(int cpu) { return Elapsed(cpu) > 0; }
+  // Share of a cpu's elapsed time spent in each field, see HasData().
+  double Fraction(int cpu, int field) {
+    auto total = Elapsed(cpu);
+    return total > 0 ? (double) deltas[cpu * NrFields + field] / total : 0;
+  }
+  double Busy(int cpu) {
+    return 1 - Fraction(cpu, Idle) - Fraction(cpu, IOWait) - Fraction(cpu, Steal);
+  }
+  size_t ColumnWidth() { return NrCpus() > 64 ? 2 : 6; }
+
+  size_t FormatPrefix(char *str, size_t size) {
+    size_t len = Format(str, size, "CPU: ");
+    if (!cpuinfo.is_open())
+      len += Format(str + len, size - len, "%dx %s  ", nr_socks, model.c_str());
+    return len;
   }
 
   size_t Width() final override {
-    return 100 + 50 * rates.size();
+    char str[128];
+    size_t len = FormatPrefix(str, sizeof(str));
+    summary_x = 16 + TextWidth(str, len);
+    // Room for the widest summary.
+    columns_x = summary_x + TextWidth("100% st 100%  ", 14);
+    return columns_x + (ColumnWidth() + 1) * NrCpus();
+  }
+  void RenderStatic(RenderContext *ctx) final override {
+    char str[128];
+    size_t len = FormatPrefix(str, sizeof(str));
+    ctx->DrawBitmap(this, cpu_icon, 8, 8, 4);
+    ctx->DrawText(this, str, len, 16);
   }
   void Render(RenderContext *ctx) final override {
-    std::stringstream str;
-    str << "CPU: " << nr_socks << "x " << model << "  ";
-    for (auto pct: rates) {
-     str << pct << "% ";
+    static const ushort colors[][3] = {
+      {0x74 << 8, 0xD3 << 8, 0x71 << 8},
+      {0xE0 << 8, 0x50 << 8, 0x50 << 8},
+      {0x50 << 8, 0x80 << 8, 0xE0 << 8},
+      {0x89 << 8, 0x71 << 8, 0xC1 << 8},
+      {0xF0 << 8, 0xD0 << 8, 0x30 << 8},
+    };
+    char str[32];
+    size_t len;
+    if (HasData(0)) {
+      len = Format(str, sizeof(str), "%d%%", (int) std::lrint(100 * Busy(0)));
+      int steal = std::lrint(100 * Fraction(0, Steal));
+      if (steal > 0) len += Format(str + len, sizeof(str) - len, " st %d%%", steal);
+    } else {
+      len = Format(str, sizeof(str), "?");
     }
-    ctx->DrawBitmap(this, cpu_icon, 8, 8, 4);
-    ctx->DrawText(this, str.str(), 16);
+    ctx->DrawText(this, str, len, summary_x);
+
+    size_t w = ColumnWidth();
+    for (int cpu = 1; cpu <= NrCpus(); cpu++) {
+      if (!HasData(cpu)) continue;
+      double base = 0;
+      for (int f = User; f < Idle; f++) {
+        double fill = Fraction(cpu, f);
+        ctx
+            ->SetColor(colors[f][0], colors[f][1], colors[f][2])
+            ->DrawColumn(this, columns_x + (w + 1) * (cpu - 1), w, fill, base);
+        base += fill;
+      }
+    }
+    ctx->ResetColor();
   }
   void OnAdd(Bar *bar) final override {
+    bar->RegisterSampledFile(
+        "/proc/stat", [=](const char *buf, size_t len) { ParseStat(buf, len); });
     BaseRateWidget::OnAdd(bar);
     cpu_icon = bar->LoadBitmap(icons::cpu_bits, 8, 8);
+
+    // Busy percent, "cpu" for the whole machine and "cpuN" for each core.
+    // Left alone while there is no data, rather than reading 100%.
+    std::vector<double *> busy;
+    busy.push_back(bar->RegisterMetric(this, "cpu"));
+    for (int cpu = 0; cpu < NrCpus(); cpu++) {
+      busy.push_back(bar->RegisterMetric(this, "cpu" + std::to_string(cpu)));
+    }
+    bar->RegisterPerSecondRefresh([=]() {
+        if (cpuinfo.is_open())
+          LoadCpuinfo();
+        for (int cpu = 0; cpu < busy.size() && cpu <= NrCpus(); cpu++) {
+          if (HasData(cpu)) *busy[cpu] = 100 * Busy(cpu);
+        }
+      });
   }
 };
 
@@ -190,9 +447,76 @@ template <> Widget *Factory<Widget, CpuKind>::Construct() { return new CpuWidget
 class MemoryWidget : public Widget, public StringUtils {
   uint64_t total = 0, free = 0, buffer_cache = 0;
   Pixmap memory_icon;
+
+  // Only shown on NUMA machines, one small bar per node.
+  struct Node {
+    int id;
+    uint64_t total, free, file;
+    uint64_t miss, foreign;
+    uint64_t last_miss, last_foreign;
+    int64_t foreign_rate;
+  };
+  std::vector<Node> nodes;
+  int64_t miss_rate = 0;
+  uint64_t last_sample;
+  double *pressure = nullptr;
+
+  static const size_t kNodeWidth = 26;
+  static const size_t kMissWidth = 80;
  public:
-  void Refresh() final override {
-    std::ifstream fin("/proc/meminfo");
+  MemoryWidget() {
+    Sampler::ReadOnce("/proc/meminfo", [=](const char *buf, size_t len) { ParseMeminfo(buf, len); });
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir) {
+      struct dirent *ent;
+      while ((ent = readdir(dir)) != nullptr) {
+        if (strncmp(ent->d_name, "node", 4) != 0 || !isdigit(ent->d_name[4])) continue;
+        nodes.push_back(Node{atoi(ent->d_name + 4), 0, 0, 0, 0, 0, 0, 0, 0});
+      }
+      closedir(dir);
+    }
+    if (nodes.size() < 2) nodes.clear();
+    std::sort(nodes.begin(), nodes.end(), [](const Node &a, const Node &b) { return a.id < b.id; });
+    for (size_t i = 0; i < nodes.size(); i++) {
+      Sampler::ReadOnce(NodePath(i, "numastat"),
+                        [=](const char *buf, size_t len) { ParseNumastat(i, buf); });
+      nodes[i].last_miss = nodes[i].miss;
+      nodes[i].last_foreign = nodes[i].foreign;
+      Sampler::ReadOnce(NodePath(i, "meminfo"),
+                        [=](const char *buf, size_t len) { ParseNodeMeminfo(i, buf); });
+    }
+    last_sample = NowNanos();
+  }
+
+  std::string NodePath(size_t i, std::string file) {
+    return "/sys/devices/system/node/node" + std::to_string(nodes[i].id) + "/" + file;
+  }
+  void ParseNodeMeminfo(size_t i, const char *buf) {
+    auto &n = nodes[i];
+    n.total = FindValue(buf, "MemTotal:");
+    n.free = FindValue(buf, "MemFree:");
+    n.file = FindValue(buf, "FilePages:");
+  }
+  void ParseNumastat(size_t i, const char *buf) {
+    nodes[i].miss = FindValue(buf, "numa_miss ");
+    nodes[i].foreign = FindValue(buf, "numa_foreign ");
+  }
+  void UpdateRates() {
+    auto now = NowNanos();
+    auto elapsed = std::max<uint64_t>(1, now - last_sample);
+    int64_t miss = 0;
+    for (auto &n: nodes) {
+      miss += n.miss - n.last_miss;
+      n.foreign_rate = (int64_t) (n.foreign - n.last_foreign) * 1000000000LL / (int64_t) elapsed;
+      n.last_miss = n.miss;
+      n.last_foreign = n.foreign;
+    }
+    miss_rate = miss * 1000000000LL / (int64_t) elapsed;
+    last_sample = now;
+  }
+  void ParseMeminfo(const char *buf, size_t len) {
+    std::istringstream fin(std::string(buf, len));
     buffer_cache = 0;
     for (std::string line; std::getline(fin, line); ) {
       if (StartsWith(line, "MemTotal:")) {
@@ -208,105 +532,257 @@ class MemoryWidget : public Widget, public StringUtils {
     }
   }
 
-  size_t Width() final override { return 120; }
+  void Refresh() final override {}
+  // Whole percents, as drawn.
+  bool Adaptive() final override { return total > 0; }
+  uint64_t Digest() final override {
+    uint64_t h = Mix(0, (total - free - buffer_cache) * 100 / total);
+    h = Mix(h, buffer_cache * 100 / total);
+    for (auto &n: nodes) {
+      if (n.total == 0) continue;
+      h = Mix(h, (n.total - n.free - n.file) * 100 / n.total);
+      h = Mix(h, n.file * 100 / n.total);
+      h = Mix(h, n.foreign_rate > 0);
+    }
+    h = Mix(h, miss_rate);
+    return Mix(h, pressure ? (uint64_t) *pressure : 0);
+  }
+
+  size_t Width() final override {
+    if (nodes.empty()) return 120;
+    return 120 + kNodeWidth * nodes.size() + kMissWidth;
+  }
+  // Free memory is whatever of the track is left uncovered.
+  void RenderStatic(RenderContext *ctx) final override {
+    ctx
+        ->DrawBitmap(this, memory_icon, 8, 8, 4)
+        ->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8)
+        ->DrawBlock(this, 16, 100);
+    long offset = 120;
+    for (auto &n: nodes) {
+      if (n.total == 0) continue;
+      ctx->DrawColumn(this, offset, kNodeWidth - 4, 1);
+      offset += kNodeWidth;
+    }
+    ctx->ResetColor();
+  }
   void Render(RenderContext *ctx) final override {
     int p = (total - free - buffer_cache) * 100 / total;
     int q = buffer_cache * 100 / total;
-    int r = free * 100 / total;
-    ctx->DrawBitmap(this, memory_icon, 8, 8, 4);
 
     ctx
         ->SetColor(0x89 << 8, 0x71 << 8, 0xC1 << 8)
         ->DrawBlock(this, 16, p)
         ->SetColor(0x74 << 8, 0xD3 << 8, 0x71 << 8)
-        ->DrawBlock(this, 16 + p, q)
-        ->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8)
-        ->DrawBlock(this, 16 + p + q, r);
+        ->DrawBlock(this, 16 + p, q);
+
+    long offset = 120;
+    for (auto &n: nodes) {
+      if (n.total == 0) continue;
+      // Used at the bottom, page cache on top of it. A node whose own
+      // allocations spill over to other nodes (numa_foreign) turns red.
+      double used = (double) (n.total - n.free - n.file) / n.total;
+      double file = (double) n.file / n.total;
+      if (n.foreign_rate > 0) {
+        ctx
+            ->SetColor(0xE0 << 8, 0x50 << 8, 0x50 << 8)
+            ->DrawColumn(this, offset, kNodeWidth - 4, 1);
+      }
+      ctx
+          ->SetColor(0x89 << 8, 0x71 << 8, 0xC1 << 8)
+          ->DrawColumn(this, offset, kNodeWidth - 4, used)
+          ->SetColor(0x74 << 8, 0xD3 << 8, 0x71 << 8)
+          ->DrawColumn(this, offset, kNodeWidth - 4, file, used);
+      offset += kNodeWidth;
+    }
+    if (!nodes.empty()) {
+      char str[32];
+      size_t len = Format(str, sizeof(str), "miss %lld/s", (long long) miss_rate);
+      if (miss_rate > 0) ctx->SetColor(0xE0 << 8, 0x50 << 8, 0x50 << 8);
+      else ctx->ResetColor();
+      ctx->DrawText(this, str, len, offset);
+    }
 
     ctx->ResetColor();
   }
   void OnAdd(Bar *bar) final override {
     memory_icon = bar->LoadBitmap(icons::mem_bits, 8, 8);
+    bar->RegisterSampledFile(
+        "/proc/meminfo", [=](const char *buf, size_t len) { ParseMeminfo(buf, len); });
+    // Same batch as everything else, so more nodes only add reads to it.
+    for (size_t i = 0; i < nodes.size(); i++) {
+      bar->RegisterSampledFile(
+          NodePath(i, "meminfo"), [=](const char *buf, size_t len) { ParseNodeMeminfo(i, buf); });
+      bar->RegisterSampledFile(
+          NodePath(i, "numastat"), [=](const char *buf, size_t len) { ParseNumastat(i, buf); }, 512);
+    }
+    if (!nodes.empty()) {
+      bar->RegisterPerSecondRefresh([=]() { UpdateRates(); });
+    }
+
+    auto used = bar->RegisterMetric(this, "memory");
+    pressure = bar->RegisterMetric(this, "memory.pressure");
+    bar->RegisterSampledFile(
+        "/proc/pressure/memory",
+        [=](const char *buf, size_t len) {
+          auto p = strstr(buf, "avg10=");
+          if (p) *pressure = strtod(p + 6, nullptr);
+        }, 512);
+    bar->RegisterPerSecondRefresh([=]() {
+        if (total > 0) *used = 100.0 * (total - free - buffer_cache) / total;
+      });
   }
 };
 
 template <> Widget *Factory<Widget, MemoryKind>::Construct() { return new MemoryWidget(); }
 
 class StorageWidget : public BaseRateWidget, public DeviceUtil {
+  std::vector<std::string> devices;
+  std::vector<std::array<uint64_t, 2>> sectors;
+  long read_width = 0, write_width = 0; // of "R: " and "W: "
  public:
-  StorageWidget() : BaseRateWidget(Count()) {}
+  StorageWidget() {
+    for (auto dev: ListDevices("block")) {
+      if (IsPhysicalDevice("block", dev)) devices.push_back(dev);
+    }
+    sectors.resize(devices.size());
+    for (size_t i = 0; i < devices.size(); i++) {
+      Sampler::ReadOnce(StatPath("block", devices[i], "stat"),
+                        [=](const char *buf, size_t len) { ParseStat(i, buf, len); });
+    }
+    Reset();
+  }
+  void ParseStat(size_t i, const char *buf, size_t len) {
+    std::istringstream fin(std::string(buf, len));
+    uint64_t vec[7] = {};
+    for (auto &n: vec) fin >> n;
+    sectors[i] = {{vec[2], vec[6]}};
+  }
+  bool Bursty() override final { return true; }
+  // Sampled fast, it keeps up anyway. Otherwise idle disks can wait.
+  bool Adaptive() override final { return !Fast(); }
+  uint64_t Digest() override final { return Mix(rates[0] / 1024, rates[1] / 1024); }
   std::vector<uint64_t> Count() override final {
-    auto devices = ListDevices("block");
     std::vector<uint64_t> io(2);
-
-    for (auto dev: devices) {
-      if (!IsPhysicalDevice("block", dev)) continue;
-      auto vec = ReadStat("block", dev, "stat");
-      io[0] += vec[2] / 2;
-      io[1] += vec[6] / 2;
+    for (auto &s: sectors) {
+      io[0] += s[0] / 2;
+      io[1] += s[1] / 2;
     }
     return io;
   }
 
   size_t Width() final override {
-    return 150;
+    return 2 * RateWidth(75);
+  }
+  void RenderStatic(RenderContext *ctx) final override {
+    read_width = ctx->TextWidth("R: ", 3);
+    write_width = ctx->TextWidth("W: ", 3);
+    ctx
+        ->DrawText(this, "R: ", 3)
+        ->DrawText(this, "W: ", 3, RateWidth(75));
   }
   void Render(RenderContext *ctx) final override {
-    {
-      std::stringstream str;
-      str << "R: " << rates[0] / 1024 << "MB/s";
-      ctx->DrawText(this, str.str());
-    }
-    {
-      std::stringstream str;
-      str << "W: " << rates[1] / 1024 << "MB/s";
-      ctx->DrawText(this, str.str(), 75);
+    char str[64];
+    size_t len = FormatRate(str, sizeof(str), 0, 1024);
+    len += Format(str + len, sizeof(str) - len, "MB/s");
+    ctx->DrawText(this, str, len, read_width);
+
+    len = FormatRate(str, sizeof(str), 1, 1024);
+    len += Format(str + len, sizeof(str) - len, "MB/s");
+    ctx->DrawText(this, str, len, RateWidth(75) + write_width);
+  }
+  void OnAdd(Bar *bar) final override {
+    for (size_t i = 0; i < devices.size(); i++) {
+      bar->RegisterSampledFile(StatPath("block", devices[i], "stat"),
+                               [=](const char *buf, size_t len) { ParseStat(i, buf, len); },
+                               4096, Fast());
     }
+    BaseRateWidget::OnAdd(bar);
+    auto read = bar->RegisterMetric(this, "storage.read");
+    auto write = bar->RegisterMetric(this, "storage.write");
+    bar->RegisterPerSecondRefresh([=]() {
+        *read = rates[0] / 1024.0;
+        *write = rates[1] / 1024.0;
+      });
   }
 };
 
 template <> Widget *Factory<Widget, StorageKind>::Construct() { return new StorageWidget(); }
 
 class NetworkWidget : public BaseRateWidget, public DeviceUtil {
+  std::vector<std::string> devices;
+  std::vector<std::array<uint64_t, 2>> bytes;
   Pixmap net_up_icon, net_down_icon;
+
+  static constexpr const char *kNodes[2] = {
+    "statistics/rx_bytes", "statistics/tx_bytes",
+  };
  public:
-  NetworkWidget() : BaseRateWidget(Count()) {}
+  NetworkWidget() {
+    for (auto dev: ListDevices("net")) {
+      if (IsPhysicalDevice("net", dev)) devices.push_back(dev);
+    }
+    bytes.resize(devices.size());
+    for (size_t i = 0; i < devices.size(); i++) {
+      for (int k = 0; k < 2; k++) {
+        Sampler::ReadOnce(StatPath("net", devices[i], kNodes[k]),
+                          [=](const char *buf, size_t len) { bytes[i][k] = strtoull(buf, nullptr, 10); });
+      }
+    }
+    Reset();
+  }
+  bool Bursty() override final { return true; }
+  bool Adaptive() override final { return !Fast(); }
+  uint64_t Digest() override final { return Mix(rates[0] / 1024, rates[1] / 1024); }
   std::vector<uint64_t> Count() override final {
-    auto devices = ListDevices("net");
     std::vector<uint64_t> net(2);
-    for (auto dev: devices) {
-      if (!IsPhysicalDevice("net", dev)) continue;
-      net[0] += ReadStat("net", dev, "statistics/rx_bytes")[0];
-      net[1] += ReadStat("net", dev, "statistics/tx_bytes")[0];
+    for (auto &b: bytes) {
+      net[0] += b[0];
+      net[1] += b[1];
     }
     return net;
   }
 
   size_t Width() final override {
-    return 140;
+    return 2 * RateWidth(70);
   }
-  void Render(RenderContext *ctx) final override {
+  void RenderStatic(RenderContext *ctx) final override {
     ctx
         ->DrawBitmap(this, net_down_icon, 8, 8, 4)
-        ->DrawBitmap(this, net_up_icon, 8, 8, 4 + 70);
-    {
-      std::stringstream str;
-      str << rates[0] / 1024 << "KB/s";
-      ctx->DrawText(this, str.str(), 16);
-    }
-    {
-      std::stringstream str;
-      str << rates[1] / 1024 << "KB/s";
-      ctx->DrawText(this, str.str(), 16 + 70);
-    }
+        ->DrawBitmap(this, net_up_icon, 8, 8, 4 + RateWidth(70));
+  }
+  void Render(RenderContext *ctx) final override {
+    char str[64];
+    size_t len = FormatRate(str, sizeof(str), 0, 1024);
+    len += Format(str + len, sizeof(str) - len, "KB/s");
+    ctx->DrawText(this, str, len, 16);
+
+    len = FormatRate(str, sizeof(str), 1, 1024);
+    len += Format(str + len, sizeof(str) - len, "KB/s");
+    ctx->DrawText(this, str, len, 16 + RateWidth(70));
   }
   void OnAdd(Bar *bar) final override {
+    for (size_t i = 0; i < devices.size(); i++) {
+      for (int k = 0; k < 2; k++) {
+        bar->RegisterSampledFile(StatPath("net", devices[i], kNodes[k]),
+                                 [=](const char *buf, size_t len) { bytes[i][k] = strtoull(buf, nullptr, 10); },
+                                 64, Fast());
+      }
+    }
     BaseRateWidget::OnAdd(bar);
     net_up_icon = bar->LoadBitmap(icons::net_up_03_bits, 8, 8);
     net_down_icon = bar->LoadBitmap(icons::net_down_03_bits, 8, 8);
+    auto rx = bar->RegisterMetric(this, "net.rx");
+    auto tx = bar->RegisterMetric(this, "net.tx");
+    bar->RegisterPerSecondRefresh([=]() {
+        *rx = rates[0] / 1024.0;
+        *tx = rates[1] / 1024.0;
+      });
   }
 };
 
+constexpr const char *NetworkWidget::kNodes[2];
+
 template <> Widget *Factory<Widget, NetworkKind>::Construct() { return new NetworkWidget(); }
 
 class BacklightWidget : public Widget, public DeviceUtil, public StringUtils {
@@ -328,32 +804,45 @@ class BacklightWidget : public Widget, public DeviceUtil, public StringUtils {
           break;
         }
       }
-      Refresh();
+      max = ReadStat("backlight", device, "max_brightness")[0];
+      Reload();
     }
   }
-  void Refresh() override final {
-    if (!enabled) return;
-    max = ReadStat("backlight", device, "max_brightness")[0];
+  // Sampled every second, but re-read right away after we changed it.
+  void Reload() {
     value = ReadStat("backlight", device, "brightness")[0];
   }
+  void Refresh() override final {}
+  bool Adaptive() override final { return enabled; }
+  uint64_t Digest() override final { return value; }
   size_t Width() final override {
     if (!enabled) return 0;
     return 120;
   }
+  void RenderStatic(RenderContext *ctx) override final {
+    if (!enabled) return;
+    ctx
+        ->DrawBitmap(this, backlight_icon, 9, 9, 4)
+        ->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8)
+        ->DrawBlock(this, 16, 100)
+        ->ResetColor();
+  }
   void Render(RenderContext *ctx) override final {
     if (!enabled) return;
     int pct = value * 100 / max;
     ctx
-        ->DrawBitmap(this, backlight_icon, 9, 9, 4)
         ->SetColor(0xFF << 8, 0xFF << 8, 0xFF << 8)
         ->DrawBlock(this, 16, pct)
-        ->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8)
-        ->DrawBlock(this, 16 + pct, 100 - pct)
         ->ResetColor();
   }
 
   void OnAdd(Bar *bar) override final {
     backlight_icon = bar->LoadBitmap(icons::brightness_bits, 9, 9);
+    if (enabled) {
+      bar->RegisterSampledFile(
+          StatPath("backlight", device, "brightness"),
+          [=](const char *buf, size_t len) { value = strtoull(buf, nullptr, 10); }, 64);
+    }
     bar->RegisterCommand(
         "brightness-up",
         [=]() {
@@ -362,6 +851,7 @@ class BacklightWidget : public Widget, public DeviceUtil, public StringUtils {
             WriteStat("backlight", device, "brightness",
                       std::min(max, value + max / 10));
           }
+          Reload();
           bar->Refresh();
         });
     bar->RegisterCommand(
@@ -372,6 +862,7 @@ class BacklightWidget : public Widget, public DeviceUtil, public StringUtils {
             WriteStat("backlight", device, "brightness",
                       std::max((int64_t) 0, (int64_t) (value - max / 10)));
           }
+          Reload();
           bar->Refresh();
         });
   }
@@ -380,30 +871,32 @@ class BacklightWidget : public Widget, public DeviceUtil, public StringUtils {
 template <> Widget *Factory<Widget, BacklightKind>::Construct() { return new BacklightWidget(); }
 
 class TimeWidget : public Widget {
-  struct tm *local;
+  struct tm local;
   Pixmap clock_icon;
  public:
   TimeWidget() {
     Refresh();
   }
   void Refresh() override final {
+    // localtime() reloads the zone and allocates on every call, that is done
+    // once a tick instead.
     time_t t = time(NULL);
-    local = localtime(&t);
+    localtime_r(&t, &local);
   }
   size_t Width() override final {
     return 130;
   }
   void Render(RenderContext *ctx) override final {
     char fmt[128];
-    strftime(fmt, 128, "%b-%d %a %H:%M", local);
-    auto m = std::numeric_limits<unsigned short>::max();
-    ctx->SetColor(0, 0, 0);
+    size_t len = strftime(fmt, 128, "%b-%d %a %H:%M", &local);
+    ctx->DrawText(this, fmt, len, 16);
+  }
+  void RenderStatic(RenderContext *ctx) override final {
     ctx->DrawBitmap(this, clock_icon, 8, 8, 4);
-    ctx->ResetColor();
-    ctx->DrawText(this, std::string(fmt), 16);
   }
   void OnAdd(Bar *bar) final override {
     clock_icon = bar->LoadBitmap(icons::clock_bits, 8, 8);
+    bar->RegisterPerSecondRefresh([]() { tzset(); });
   }
 };
 
@@ -413,36 +906,74 @@ class VolumeWidget : public Widget {
   bool enabled = false;
   pa_cvolume volume;
   pa_mainloop *loop;
-  pa_context *ctx;
+  pa_context *ctx = nullptr;
   Pixmap speaker_icon;
   std::vector<int> sinks;
+  int retry = 0;
 
- public:
-  VolumeWidget() {
-    loop = pa_mainloop_new();
-    auto api = pa_mainloop_get_api(loop);
-    ctx = pa_context_new(api, "");
-    bool ready = false;
-
-    pa_context_set_state_callback(ctx, [](pa_context *ctx, void *ptr) {
-        if (pa_context_get_state(ctx) == PA_CONTEXT_READY) {
-          auto ready = (bool *) ptr;
-          *ready = true;
-        }
-      }, &ready);
+  // Pulse may be slow or not running at all. Never wait on it for longer
+  // than this per tick, and try connecting again every kRetryTicks.
+  static const int kTimeout = 50000; // us
+  static const int kRetryTicks = 30;
 
-    if (pa_context_connect(ctx, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
-      return;
+  void Connect() {
+    if (ctx) {
+      pa_context_disconnect(ctx);
+      pa_context_unref(ctx);
     }
+    ctx = pa_context_new(pa_mainloop_get_api(loop), "");
+    retry = kRetryTicks;
+    pa_context_connect(ctx, NULL, PA_CONTEXT_NOFLAGS, NULL);
+  }
 
-    while (!ready) {
-      int ret;
-      pa_mainloop_iterate(loop, 1, &ret);
+  // Runs the pulse main loop until done() or the timeout.
+  bool Wait(std::function<bool ()> done) {
+    auto deadline = NowNanos() + kTimeout * 1000ULL;
+    while (!done()) {
+      auto now = NowNanos();
+      if (now >= deadline)
+        return false;
+      if (pa_mainloop_prepare(loop, (deadline - now) / 1000) < 0
+          || pa_mainloop_poll(loop) < 0 || pa_mainloop_dispatch(loop) < 0)
+        return false;
     }
+    return true;
+  }
 
-    Refresh();
+  bool Wait(pa_operation *o) {
+    bool done = Wait([o]() { return pa_operation_get_state(o) != PA_OPERATION_RUNNING; });
+    if (!done)
+      pa_operation_cancel(o);
+    pa_operation_unref(o);
+    return done;
   }
-  void Refresh() override final {
+
+ public:
+  // Only starts connecting, the widget shows up once pulse answers.
+  VolumeWidget() : loop(pa_mainloop_new()) {
+    Connect();
+  }
+  void Refresh() override final {}
+  // Once a tick rather than in Refresh(), pulse allocates on every request.
+  void Update() {
+    auto state = pa_context_get_state(ctx);
+    if (state != PA_CONTEXT_READY) {
+      Wait([this]() {
+          auto state = pa_context_get_state(ctx);
+          return state == PA_CONTEXT_READY || state == PA_CONTEXT_FAILED
+              || state == PA_CONTEXT_TERMINATED;
+        });
+      state = pa_context_get_state(ctx);
+    }
+    if (state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED) {
+      if (enabled) InvalidateLayout();
+      enabled = false;
+      if (--retry <= 0) Connect();
+      return;
+    }
+    if (state != PA_CONTEXT_READY)
+      return;
+
     // TODO: What to display if there are multiple sinks?
     sinks.clear();
     auto o = pa_context_get_sink_info_list(
@@ -453,6 +984,7 @@ class VolumeWidget : public Widget {
           }
           auto w = (VolumeWidget *) ptr;
           w->volume = sink->volume;
+          if (!w->enabled) w->InvalidateLayout();
           w->enabled = true;
           // printf("%s\n", sink->name);
           w->sinks.push_back(sink->index);
@@ -462,11 +994,7 @@ class VolumeWidget : public Widget {
       puts("Error");
       return;
     }
-    while (pa_operation_get_state(o) == PA_OPERATION_RUNNING) {
-      int ret;
-      pa_mainloop_iterate(loop, 1, &ret);
-    }
-    pa_operation_unref(o);
+    Wait(o);
   }
   void SetVolume() {
     if (!enabled) return;
@@ -476,18 +1004,14 @@ class VolumeWidget : public Widget {
           ctx, sink_id, &volume,
           [](pa_context *ctx, int success, void *ptr) {}, this);
 
-      if (!o)
+      if (!o || !Wait(o))
         return;
-      while (pa_operation_get_state(o) == PA_OPERATION_RUNNING) {
-        int ret;
-        pa_mainloop_iterate(loop, 1, &ret);
-      }
-      pa_operation_unref(o);
     }
   }
 
   void OnAdd(Bar *bar) override final {
     speaker_icon = bar->LoadBitmap(icons::spkr_01_bits, 8, 8);
+    bar->RegisterPerSecondRefresh([=]() { Update(); });
     bar->RegisterCommand(
         "vol-up",
         [=]() {
@@ -511,13 +1035,19 @@ class VolumeWidget : public Widget {
     for (int i = 0; i < volume.channels; i++) {
       s += volume.values[i];
     }
-    int pct = s * 100 / volume.channels / PA_VOLUME_NORM;
+    // Over 100% would run past the track.
+    int pct = std::min<uint64_t>(100, s * 100 / volume.channels / PA_VOLUME_NORM);
     ctx
-        ->DrawBitmap(this, speaker_icon, 8, 8, 4)
         ->SetColor(0xFF << 8, 0xFF << 8, 0xFF << 8)
         ->DrawBlock(this, 16, pct)
+        ->ResetColor();
+  }
+  void RenderStatic(RenderContext *ctx) override final {
+    if (!enabled) return;
+    ctx
+        ->DrawBitmap(this, speaker_icon, 8, 8, 4)
         ->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8)
-        ->DrawBlock(this, 16 + pct, 100 - pct)
+        ->DrawBlock(this, 16, 100)
         ->ResetColor();
   }
 };
@@ -526,40 +1056,1255 @@ template <> Widget *Factory<Widget, VolumeKind>::Construct() { return new Volume
 
 class BatteryWidget : public Widget, public DeviceUtil {
   std::vector<std::string> bat_devs;
+  std::vector<uint64_t> now;
   uint64_t tot_full;
   uint64_t tot_now;
   Pixmap battery_icon;
  public:
   BatteryWidget() : tot_full(0), tot_now(0) {
     bat_devs = ListDevices("power_supply");
-    for (const auto &bat_dev: bat_devs) {
-      auto stats = ReadStat("power_supply", bat_dev, "energy_full");
+    now.resize(bat_devs.size());
+    for (size_t i = 0; i < bat_devs.size(); i++) {
+      auto stats = ReadStat("power_supply", bat_devs[i], "energy_full");
       if (stats.size() == 0) continue;
       tot_full += stats[0];
-    }
-  }
-  void Refresh() final override {
-    tot_now = 0;
-    for (const auto &bat_dev: bat_devs) {
-      auto stats = ReadStat("power_supply", bat_dev, "energy_now");
+      stats = ReadStat("power_supply", bat_devs[i], "energy_now");
       if (stats.size() == 0) continue;
-      tot_now += stats[0];
+      now[i] = stats[0];
+      tot_now += now[i];
     }
   }
+  void Refresh() final override {}
+  bool Adaptive() final override { return tot_full > 0; }
+  uint64_t Digest() final override { return 100ULL * tot_now / tot_full; }
   size_t Width() final override { return 64; }
   void Render(RenderContext *ctx) final override {
     if (bat_devs.size() == 0) return;
     int pct = 100ULL * tot_now / tot_full;
-    ctx
-        ->DrawBitmap(this, battery_icon, 16, 16, 4)
-        ->DrawText(this, std::to_string(pct) + "%", 20)
-        ->ResetColor();
+    char str[16];
+    size_t len = Format(str, sizeof(str), "%d%%", pct);
+    ctx->DrawText(this, str, len, 20);
+  }
+  void RenderStatic(RenderContext *ctx) final override {
+    if (bat_devs.size() == 0) return;
+    ctx->DrawBitmap(this, battery_icon, 16, 16, 4);
   }
   void OnAdd(Bar *bar) final override {
     battery_icon = bar->LoadBitmap(icons::battery_bits, 16, 16);
+    for (size_t i = 0; i < bat_devs.size(); i++) {
+      bar->RegisterSampledFile(
+          StatPath("power_supply", bat_devs[i], "energy_now"),
+          [=](const char *buf, size_t len) {
+            uint64_t v = strtoull(buf, nullptr, 10);
+            tot_now += v - now[i];
+            now[i] = v;
+          }, 64);
+    }
+    if (tot_full > 0) {
+      auto level = bar->RegisterMetric(this, "battery");
+      bar->RegisterPerSecondRefresh([=]() { *level = 100.0 * tot_now / tot_full; });
+    }
   }
 };
 
 template <> Widget *Factory<Widget, BatteryKind>::Construct() { return new BatteryWidget(); }
 
+class HwmonWidget : public Widget, public DeviceUtil, public StringUtils {
+  struct Sensor {
+    int fd;
+    bool is_fan;
+    bool is_package;
+    int interval; // in seconds, grows for slow sensors
+    int countdown;
+    int64_t value;
+  };
+  std::vector<Sensor> sensors; // the reader's only
+  bool has_package = false;
+  int64_t temp = 0, rpm = 0;
+  Pixmap fan_icon;
+
+  // Sensors on SMBus or the EC can take milliseconds to read, so they are
+  // read on a thread of their own and the bar shows the last pass. Slow
+  // ones are read less often, so that a pass still fits in a tick.
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool requested = false;
+  int64_t read_temp = 0, read_rpm = 0;
+
+  static const uint64_t kSlowRead = 1000000;
+  static const int kMaxInterval = 16;
+ public:
+  HwmonWidget() {
+    for (auto dev: ListDevices("hwmon")) {
+      std::string path = "/sys/class/hwmon/" + dev;
+      DIR *dir = opendir(path.c_str());
+      if (!dir) continue;
+      struct dirent *ent;
+      while ((ent = readdir(dir)) != nullptr) {
+        std::string node(ent->d_name);
+        bool is_fan = StartsWith(node, "fan");
+        if (!is_fan && !StartsWith(node, "temp")) continue;
+        if (node.length() < 6 || node.compare(node.length() - 6, 6, "_input") != 0) continue;
+
+        bool is_package = false;
+        if (!is_fan) {
+          std::ifstream fin(path + "/" + node.substr(0, node.length() - 6) + "_label");
+          std::string label;
+          if (std::getline(fin, label)) {
+            is_package = StartsWith(label, "Package") || StartsWith(label, "Tctl")
+                         || StartsWith(label, "Tdie");
+          }
+        }
+
+        int fd = OpenStat("hwmon", dev, node);
+        if (fd < 0) continue;
+        sensors.push_back(Sensor{fd, is_fan, is_package, 1, 0, 0});
+        has_package |= is_package;
+      }
+      closedir(dir);
+    }
+  }
+
+  void Work() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> l(mutex);
+        cv.wait(l, [=]() { return requested; });
+        requested = false;
+      }
+      Sample();
+    }
+  }
+
+  void Request() {
+    std::lock_guard<std::mutex> l(mutex);
+    requested = true;
+    cv.notify_one();
+  }
+
+  void Sample() {
+    for (auto &s: sensors) {
+      if (s.countdown > 1) {
+        s.countdown--;
+        continue;
+      }
+      auto t = NowNanos();
+      PreadValue(s.fd, s.value);
+      if (NowNanos() - t > kSlowRead) {
+        s.interval = std::min(kMaxInterval, s.interval * 2);
+      } else {
+        s.interval = 1;
+      }
+      s.countdown = s.interval;
+    }
+
+    int64_t t = 0, r = 0;
+    for (auto &s: sensors) {
+      if (s.is_fan) {
+        r = std::max(r, s.value);
+      } else if (s.is_package || !has_package) {
+        t = std::max(t, s.value / 1000);
+      }
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    read_temp = t;
+    read_rpm = r;
+  }
+
+  void Refresh() final override {}
+  size_t Width() final override {
+    return sensors.empty() ? 0 : 110;
+  }
+  void Render(RenderContext *ctx) final override {
+    if (sensors.empty()) return;
+    char str[64];
+    size_t len = Format(str, sizeof(str), "%lld\u00b0C", (long long) temp);
+    if (rpm > 0) len += Format(str + len, sizeof(str) - len, " %lldRPM", (long long) rpm);
+    ctx->DrawText(this, str, len, 16);
+  }
+  void RenderStatic(RenderContext *ctx) final override {
+    if (sensors.empty()) return;
+    ctx->DrawBitmap(this, fan_icon, 9, 9, 4);
+  }
+  void OnAdd(Bar *bar) final override {
+    fan_icon = bar->LoadBitmap(icons::fan_bits, 9, 9);
+    if (sensors.empty())
+      return;
+    std::thread(&HwmonWidget::Work, this).detach();
+    Request();
+    auto t = bar->RegisterMetric(this, "temp");
+    bar->RegisterPerSecondRefresh([=]() {
+        {
+          std::lock_guard<std::mutex> l(mutex);
+          temp = read_temp;
+          rpm = read_rpm;
+        }
+        Request();
+        *t = temp;
+      });
+  }
+};
+
+const int HwmonWidget::kMaxInterval;
+
+template <> Widget *Factory<Widget, HwmonKind>::Construct() { return new HwmonWidget(); }
+
+class CpufreqWidget : public Widget, public DeviceUtil {
+  // Indexed by cpu id, so that column N is cpuN as in CpuWidget. Cpus
+  // without cpufreq keep an empty column.
+  std::vector<int> cpus; // the ones with cpufreq
+  std::vector<int64_t> freqs; // in kHz
+  std::vector<int64_t> max_freqs; // 0 until read
+  size_t nr_max_read = 0;
+  int64_t min_freq = 0, avg_freq = 0, max_freq = 0;
+
+  static const uint64_t kMaxFreqBudget = 1000000; // ns per tick
+
+  static std::string Path(int cpu, const char *file) {
+    return "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/" + file;
+  }
+
+  // cpuinfo_max_freq does not change, so it is not sampled. It is read a
+  // few cores at a time on the first ticks instead of before the bar shows
+  // up.
+  void LoadMaxFreqs() {
+    auto deadline = NowNanos() + kMaxFreqBudget;
+    while (nr_max_read < cpus.size() && NowNanos() < deadline) {
+      int cpu = cpus[nr_max_read++];
+      Sampler::ReadOnce(Path(cpu, "cpuinfo_max_freq"), [=](const char *buf, size_t len) {
+          max_freqs[cpu] = strtoll(buf, nullptr, 10);
+        });
+    }
+  }
+ public:
+  CpufreqWidget() {
+    DIR *dir = opendir("/sys/devices/system/cpu");
+    if (!dir) return;
+    struct dirent *ent;
+    std::vector<int> ids;
+    while ((ent = readdir(dir)) != nullptr) {
+      if (strncmp(ent->d_name, "cpu", 3) != 0 || !isdigit(ent->d_name[3])) continue;
+      ids.push_back(atoi(ent->d_name + 3));
+    }
+    closedir(dir);
+    std::sort(ids.begin(), ids.end());
+
+    for (auto cpu: ids) {
+      if (access(Path(cpu, "scaling_cur_freq").c_str(), R_OK) < 0) continue;
+      cpus.push_back(cpu);
+    }
+    if (cpus.empty()) return;
+    freqs.assign(cpus.back() + 1, 0);
+    max_freqs.assign(cpus.back() + 1, 0);
+  }
+
+  void Summarize() {
+    if (cpus.empty()) return;
+    min_freq = max_freq = freqs[cpus[0]];
+    int64_t s = 0;
+    for (auto cpu: cpus) {
+      min_freq = std::min(min_freq, freqs[cpu]);
+      max_freq = std::max(max_freq, freqs[cpu]);
+      s += freqs[cpu];
+    }
+    avg_freq = s / (int64_t) cpus.size();
+  }
+
+  // Hundreds of cores would not fit at full width.
+  size_t ColumnWidth() { return freqs.size() > 64 ? 1 : 3; }
+
+  void Refresh() final override {}
+  size_t Width() final override {
+    if (cpus.empty()) return 0;
+    return 130 + (ColumnWidth() + 1) * freqs.size();
+  }
+  void Render(RenderContext *ctx) final override {
+    if (cpus.empty()) return;
+    char str[64];
+    size_t len;
+    if (avg_freq > 0) {
+      len = Format(str, sizeof(str), "%.1f/%.1f/%.1fGHz",
+                   min_freq / 1e6, avg_freq / 1e6, max_freq / 1e6);
+    } else {
+      len = Format(str, sizeof(str), "?GHz");
+    }
+    ctx->DrawText(this, str, len);
+
+    size_t w = ColumnWidth();
+    ctx->SetColor(0xF0 << 8, 0xA0 << 8, 0x30 << 8);
+    for (auto cpu: cpus) {
+      if (max_freqs[cpu] <= 0) continue;
+      ctx->DrawColumn(this, 130 + (w + 1) * cpu, w, (double) freqs[cpu] / max_freqs[cpu]);
+    }
+    ctx->ResetColor();
+  }
+  void OnAdd(Bar *bar) final override {
+    // Every core's file goes out in the same batch as everything else.
+    for (auto cpu: cpus) {
+      bar->RegisterSampledFile(
+          Path(cpu, "scaling_cur_freq"),
+          [=](const char *buf, size_t len) { freqs[cpu] = strtoll(buf, nullptr, 10); }, 32);
+    }
+    bar->RegisterPerSecondRefresh([=]() {
+        LoadMaxFreqs();
+        Summarize();
+      });
+  }
+};
+
+template <> Widget *Factory<Widget, CpufreqKind>::Construct() { return new CpufreqWidget(); }
+
+std::vector<std::string> WidgetConfig::g_cgroups;
+std::string WidgetConfig::g_cgroup_parent;
+
+// Either the cgroups given with -c, or the busiest children of -C (the root
+// by default).
+class CgroupWidget : public BaseRateWidget, public StringUtils {
+  struct Group {
+    std::string name;
+    int dir_fd;
+    int cpu_fd, mem_fd, io_fd, psi_fd;
+    uint64_t memory;
+    double pressure;
+    // The last counters read, kept once the group is gone.
+    uint64_t usage, io;
+    bool gone;
+  };
+  std::string root;
+  std::vector<Group> groups;
+  std::vector<size_t> shown;
+  int parent_fd = -1;
+  int ticks = 0;
+
+  static const size_t kTopN = 3;
+  static const int kRescanTicks = 10;
+  static const size_t kGroupWidth = 180;
+
+  // -1 once the group has been removed.
+  static ssize_t ReadAt(int fd, char *buf, size_t size) {
+    buf[0] = 0;
+    if (fd < 0) return 0;
+    ssize_t n = pread(fd, buf, size - 1, 0);
+    if (n < 0) return -1;
+    buf[n] = 0;
+    return n;
+  }
+
+  bool Open(std::string path, std::string name) {
+    int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return false;
+    Group g;
+    g.name = name;
+    g.dir_fd = dir_fd;
+    g.cpu_fd = openat(dir_fd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+    g.mem_fd = openat(dir_fd, "memory.current", O_RDONLY | O_CLOEXEC);
+    g.io_fd = openat(dir_fd, "io.stat", O_RDONLY | O_CLOEXEC);
+    g.psi_fd = openat(dir_fd, "memory.pressure", O_RDONLY | O_CLOEXEC);
+    g.memory = 0;
+    g.pressure = 0;
+    g.usage = g.io = 0;
+    g.gone = false;
+    groups.push_back(g);
+    return true;
+  }
+
+  void Close() {
+    for (auto &g: groups) {
+      for (int fd: {g.cpu_fd, g.mem_fd, g.io_fd, g.psi_fd, g.dir_fd}) {
+        if (fd >= 0) close(fd);
+      }
+    }
+    groups.clear();
+  }
+
+  std::vector<std::string> Children() {
+    std::vector<std::string> res;
+    DIR *dir = fdopendir(dup(parent_fd));
+    if (!dir) return res;
+    rewinddir(dir);
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+      if (ent->d_name[0] == '.' || ent->d_type != DT_DIR) continue;
+      res.push_back(ent->d_name);
+    }
+    closedir(dir);
+    std::sort(res.begin(), res.end());
+    return res;
+  }
+
+  // Children come and go, so look again every few ticks. Counters are only
+  // reset when the set actually changed.
+  void Rescan(bool force) {
+    auto children = Children();
+    bool same = !force && children.size() == groups.size();
+    for (size_t i = 0; same && i < children.size(); i++) {
+      same = children[i] == groups[i].name;
+    }
+    if (same) return;
+    Close();
+    auto parent = root + "/" + WidgetConfig::g_cgroup_parent;
+    for (auto &c: children) {
+      Open(parent + "/" + c, c);
+    }
+    Reset();
+  }
+ public:
+  CgroupWidget() {
+    root = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0
+           ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified";
+    if (!WidgetConfig::g_cgroups.empty()) {
+      for (auto &path: WidgetConfig::g_cgroups) {
+        auto full = StartsWith(path, "/sys/") ? path : root + "/" + path;
+        auto name = path.substr(path.find_last_of('/') + 1);
+        Open(full, name.empty() ? path : name);
+      }
+      Reset();
+    } else {
+      parent_fd = open((root + "/" + WidgetConfig::g_cgroup_parent).c_str(),
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (parent_fd >= 0) Rescan(true);
+    }
+  }
+
+  // cpu usage_usec and io bytes for each group. A group removed under us
+  // keeps its last counters until the next rescan drops it, rather than
+  // dropping to 0 and wrapping the delta.
+  std::vector<uint64_t> Count() override final {
+    std::vector<uint64_t> cnts;
+    char buf[4096];
+    for (auto &g: groups) {
+      auto n = ReadAt(g.cpu_fd, buf, sizeof(buf));
+      if (n > 0) {
+        auto p = strstr(buf, "usage_usec ");
+        if (p) g.usage = strtoull(p + 11, nullptr, 10);
+      }
+      g.gone |= n < 0;
+      n = ReadAt(g.io_fd, buf, sizeof(buf));
+      if (n > 0) {
+        uint64_t io = 0;
+        for (auto p = buf; (p = strstr(p, "bytes=")) != nullptr; p += 6) {
+          if (p > buf && (p[-1] == 'r' || p[-1] == 'w'))
+            io += strtoull(p + 6, nullptr, 10);
+        }
+        g.io = io;
+      }
+      g.gone |= n < 0;
+      if (ReadAt(g.mem_fd, buf, sizeof(buf)) > 0) {
+        g.memory = strtoull(buf, nullptr, 10);
+      }
+      if (ReadAt(g.psi_fd, buf, sizeof(buf)) > 0) {
+        auto p = strstr(buf, "avg10=");
+        if (p) g.pressure = strtod(p + 6, nullptr);
+      }
+      cnts.push_back(g.usage);
+      cnts.push_back(g.io);
+    }
+    return cnts;
+  }
+
+  void Rank() {
+    shown.clear();
+    for (size_t i = 0; i < groups.size(); i++) shown.push_back(i);
+    if (parent_fd < 0) return;
+    // Busiest first, memory breaks the ties between idle groups.
+    std::sort(shown.begin(), shown.end(), [=](size_t a, size_t b) {
+        if (rates[2 * a] != rates[2 * b]) return rates[2 * a] > rates[2 * b];
+        return groups[a].memory > groups[b].memory;
+      });
+    if (shown.size() > kTopN) shown.resize(kTopN);
+  }
+
+  size_t Width() final override {
+    if (parent_fd >= 0) return kTopN * kGroupWidth;
+    return groups.size() * kGroupWidth;
+  }
+  void Render(RenderContext *ctx) final override {
+    for (size_t i = 0; i < shown.size(); i++) {
+      auto k = shown[i];
+      if (2 * k + 1 >= rates.size()) continue;
+      auto &g = groups[k];
+      char str[64];
+      size_t len = Format(str, sizeof(str), "%.16s %lld%% %lluM %lldM/s", g.name.c_str(),
+                          (long long) (rates[2 * k] / 10000),
+                          (unsigned long long) (g.memory >> 20),
+                          (long long) (rates[2 * k + 1] >> 20));
+      if (g.pressure >= 10) ctx->SetColor(0xE0 << 8, 0x50 << 8, 0x50 << 8);
+      ctx->DrawText(this, str, len, i * kGroupWidth)->ResetColor();
+    }
+  }
+  void OnAdd(Bar *bar) final override {
+    BaseRateWidget::OnAdd(bar);
+    Rank();
+    bar->RegisterPerSecondRefresh([=]() {
+        bool gone = std::any_of(groups.begin(), groups.end(), [](const Group &g) { return g.gone; });
+        if (parent_fd >= 0 && (++ticks % kRescanTicks == 0 || gone)) Rescan(gone);
+        Rank();
+      });
+  }
+};
+
+template <> Widget *Factory<Widget, CgroupKind>::Construct() { return new CgroupWidget(); }
+
+// Scheduler and interrupt load: context switches, interrupts, runnable and
+// blocked tasks, NET_RX and TIMER softirqs per cpu, and the busiest lines of
+// /proc/interrupts.
+class ActivityWidget : public BaseRateWidget, public StringUtils {
+  // Counters are these two from /proc/stat, NET_RX and TIMER for each cpu,
+  // then one per line of /proc/interrupts.
+  enum : int {
+    Ctxt, Intr, NrStat,
+  };
+  uint64_t stat[NrStat] = {};
+  uint64_t running = 0, blocked = 0;
+  std::vector<uint64_t> net_rx, timer;
+  std::vector<uint64_t> irqs, columns;
+  std::vector<std::string> irq_names;
+  // What each line's count belongs to. Lines are replaced as drivers load
+  // and MSI vectors get allocated, not only with hotplug.
+  std::vector<std::string> irq_labels, irq_descs;
+  std::vector<size_t> top;
+
+  static const size_t kTopN = 3;
+  static const size_t kTextWidth = 170;
+  static const size_t kIrqWidth = 110;
+
+  // The header line has a CPUn per column.
+  static size_t CountCpus(const char *buf) {
+    size_t n = 0;
+    const char *eol = strchr(buf, '\n');
+    for (const char *p = buf; (p = strstr(p, "CPU")) && (!eol || p < eol); p += 3) n++;
+    return n;
+  }
+
+  // Device name for numbered lines, the label (LOC, NMI...) otherwise.
+  static std::string IrqName(const char *p, const char *colon, const char *desc, const char *eol) {
+    while (*p == ' ') p++;
+    if (*p < '0' || *p > '9') return std::string(p, colon);
+    while (eol > desc && eol[-1] == ' ') eol--;
+    auto q = eol;
+    while (q > desc && q[-1] != ' ') q--;
+    return q < eol ? std::string(q, eol) : std::string(p, colon);
+  }
+
+  void ParseStat(const char *buf, size_t len) {
+    stat[Ctxt] = FindValue(buf, "\nctxt ");
+    stat[Intr] = FindValue(buf, "\nintr ");
+    running = FindValue(buf, "\nprocs_running ");
+    blocked = FindValue(buf, "\nprocs_blocked ");
+  }
+
+  void ParseSoftirqs(const char *buf, size_t len) {
+    size_t n = CountCpus(buf);
+    if (n != net_rx.size()) InvalidateLayout();
+    net_rx.assign(n, 0);
+    timer.assign(n, 0);
+    size_t count;
+    // The leading space keeps HRTIMER out.
+    if (auto p = strstr(buf, " NET_RX:"))
+      ReadColumns(p + 8, net_rx.data(), n, count);
+    if (auto p = strstr(buf, " TIMER:"))
+      ReadColumns(p + 7, timer.data(), n, count);
+  }
+
+  // same turns false when a line is not the one last seen in its place.
+  size_t ScanInterrupts(const char *buf, size_t len, bool names, bool &same) {
+    const char *end = buf + len;
+    auto p = (const char *) memchr(buf, '\n', len);
+    size_t i = 0;
+    for (; p && ++p < end; i++) {
+      auto eol = (const char *) memchr(p, '\n', end - p);
+      if (!eol) eol = end;
+      auto colon = (const char *) memchr(p, ':', eol - p);
+      if (!colon) break;
+      size_t count;
+      auto desc = ReadColumns(colon + 1, columns.data(), columns.size(), count);
+      uint64_t sum = 0;
+      for (size_t k = 0; k < count; k++) sum += columns[k];
+      if (i == irqs.size()) irqs.push_back(0);
+      irqs[i] = sum;
+      if (names) {
+        irq_labels[i].assign(p, colon);
+        irq_descs[i].assign(desc, eol);
+        irq_names[i] = IrqName(p, colon, desc, eol);
+      } else if (same) {
+        same = i < irq_labels.size()
+               && irq_labels[i].compare(0, std::string::npos, p, colon - p) == 0
+               && irq_descs[i].compare(0, std::string::npos, desc, eol - desc) == 0;
+      }
+      p = eol;
+    }
+    irqs.resize(i);
+    return i;
+  }
+
+  void ParseInterrupts(const char *buf, size_t len) {
+    columns.resize(CountCpus(buf));
+    bool same = true;
+    size_t nr_lines = ScanInterrupts(buf, len, false, same);
+    if (!same || nr_lines != irq_names.size()) {
+      // Names are only built when the lines change, and the old counts no
+      // longer line up with the new ones.
+      irq_names.resize(nr_lines);
+      irq_labels.resize(nr_lines);
+      irq_descs.resize(nr_lines);
+      ScanInterrupts(buf, len, true, same);
+      Reset();
+    }
+  }
+
+  int64_t Rate(size_t i) { return i < rates.size() ? rates[i] : 0; }
+  size_t NetRx(size_t cpu) { return NrStat + cpu; }
+  size_t Timer(size_t cpu) { return NrStat + net_rx.size() + cpu; }
+  size_t Irq(size_t i) { return NrStat + 2 * net_rx.size() + i; }
+
+  static size_t FormatCount(char *buf, size_t size, int64_t v) {
+    if (v >= 10000000) return Format(buf, size, "%lldM", (long long) (v / 1000000));
+    if (v >= 10000) return Format(buf, size, "%lldk", (long long) (v / 1000));
+    return Format(buf, size, "%lld", (long long) v);
+  }
+
+  void Rank() {
+    top.clear();
+    for (size_t i = 0; i < irqs.size() && Irq(i) < rates.size(); i++) top.push_back(i);
+    auto n = std::min(kTopN, top.size());
+    std::partial_sort(top.begin(), top.begin() + n, top.end(), [=](size_t a, size_t b) {
+        return rates[Irq(a)] > rates[Irq(b)];
+      });
+    top.resize(n);
+  }
+
+  size_t ColumnWidth() { return net_rx.size() > 64 ? 1 : 3; }
+ public:
+  ActivityWidget() {
+    Sampler::ReadOnce("/proc/stat", [=](const char *buf, size_t len) { ParseStat(buf, len); });
+    Sampler::ReadOnce("/proc/softirqs", [=](const char *buf, size_t len) { ParseSoftirqs(buf, len); });
+    Sampler::ReadOnce("/proc/interrupts", [=](const char *buf, size_t len) { ParseInterrupts(buf, len); });
+    Reset();
+  }
+
+  std::vector<uint64_t> Count() override final {
+    std::vector<uint64_t> cnts(stat, stat + NrStat);
+    cnts.insert(cnts.end(), net_rx.begin(), net_rx.end());
+    cnts.insert(cnts.end(), timer.begin(), timer.end());
+    cnts.insert(cnts.end(), irqs.begin(), irqs.end());
+    return cnts;
+  }
+
+  size_t Width() final override {
+    return kTextWidth + (ColumnWidth() + 1) * net_rx.size() + kTopN * kIrqWidth;
+  }
+  void Render(RenderContext *ctx) final override {
+    char str[64];
+    size_t len = Format(str, sizeof(str), "cs ");
+    len += FormatCount(str + len, sizeof(str) - len, Rate(Ctxt));
+    len += Format(str + len, sizeof(str) - len, " in ");
+    len += FormatCount(str + len, sizeof(str) - len, Rate(Intr));
+    len += Format(str + len, sizeof(str) - len, " %llur %llub",
+                  (unsigned long long) running, (unsigned long long) blocked);
+    ctx->DrawText(this, str, len);
+
+    // TIMER at the bottom, NET_RX on top, against the busiest cpu.
+    size_t w = ColumnWidth();
+    int64_t max = 1;
+    for (size_t cpu = 0; cpu < net_rx.size(); cpu++) {
+      max = std::max(max, Rate(NetRx(cpu)) + Rate(Timer(cpu)));
+    }
+    long offset = kTextWidth;
+    for (size_t cpu = 0; cpu < net_rx.size(); cpu++) {
+      double t = (double) Rate(Timer(cpu)) / max;
+      double r = (double) Rate(NetRx(cpu)) / max;
+      ctx
+          ->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8)
+          ->DrawColumn(this, offset, w, t)
+          ->SetColor(0x50 << 8, 0x80 << 8, 0xE0 << 8)
+          ->DrawColumn(this, offset, w, r, t);
+      offset += w + 1;
+    }
+    ctx->ResetColor();
+
+    for (size_t k = 0; k < top.size(); k++) {
+      auto i = top[k];
+      if (i >= irq_names.size()) break;
+      len = Format(str, sizeof(str), "%.10s ", irq_names[i].c_str());
+      len += FormatCount(str + len, sizeof(str) - len, Rate(Irq(i)));
+      ctx->DrawText(this, str, len, offset + k * kIrqWidth);
+    }
+  }
+  void OnAdd(Bar *bar) final override {
+    bar->RegisterSampledFile(
+        "/proc/stat", [=](const char *buf, size_t len) { ParseStat(buf, len); });
+    bar->RegisterSampledFile(
+        "/proc/softirqs", [=](const char *buf, size_t len) { ParseSoftirqs(buf, len); }, 8192);
+    bar->RegisterSampledFile(
+        "/proc/interrupts", [=](const char *buf, size_t len) { ParseInterrupts(buf, len); },
+        65536);
+    BaseRateWidget::OnAdd(bar);
+
+    auto ctxt = bar->RegisterMetric(this, "ctxt");
+    auto intr = bar->RegisterMetric(this, "intr");
+    auto run = bar->RegisterMetric(this, "procs.running");
+    auto block = bar->RegisterMetric(this, "procs.blocked");
+    auto rx = bar->RegisterMetric(this, "softirq.net_rx");
+    auto tm = bar->RegisterMetric(this, "softirq.timer");
+    bar->RegisterPerSecondRefresh([=]() {
+        Rank();
+        *ctxt = Rate(Ctxt);
+        *intr = Rate(Intr);
+        *run = running;
+        *block = blocked;
+        *rx = *tm = 0;
+        for (size_t cpu = 0; cpu < net_rx.size(); cpu++) {
+          *rx += Rate(NetRx(cpu));
+          *tm += Rate(Timer(cpu));
+        }
+      });
+  }
+};
+
+const size_t ActivityWidget::kTopN;
+
+template <> Widget *Factory<Widget, ActivityKind>::Construct() { return new ActivityWidget(); }
+
+// Time tasks spent runnable but waiting for a cpu, from the run_delay field
+// of /proc/schedstat. Busy percent does not show contention, this does.
+class RunqueueWidget : public BaseRateWidget, public StringUtils {
+  // Nanoseconds of waiting, the sum over all cpus first.
+  std::vector<uint64_t> delays;
+
+  static const size_t kTextWidth = 110;
+
+  // One pass over the cpuN lines, skipping the domain lines under each.
+  // After "cpuN" come yld_count, a legacy zero, sched_count, sched_goidle,
+  // ttwu_count, ttwu_local, rq_cpu_time, run_delay and pcount. cpuN goes to
+  // slot N + 1, like CpuWidget::ParseStat(); offline cpus are not listed and
+  // keep their last delay, so the sum in slot 0 never goes back.
+  void ParseSchedstat(const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+    size_t old_size = delays.size();
+    if (delays.empty()) delays.push_back(0);
+    while (p < end) {
+      auto eol = (const char *) memchr(p, '\n', end - p);
+      if (!eol) eol = end;
+      if (eol - p > 3 && memcmp(p, "cpu", 3) == 0 && p[3] >= '0' && p[3] <= '9') {
+        char *q;
+        size_t slot = strtoul(p + 3, &q, 10) + 1;
+        uint64_t f[9];
+        size_t count;
+        ReadColumns(q, f, 9, count);
+        if (count >= 8) {
+          if (delays.size() <= slot) delays.resize(slot + 1, 0);
+          delays[slot] = f[7];
+        }
+      }
+      p = eol + 1;
+    }
+    delays[0] = 0;
+    for (size_t i = 1; i < delays.size(); i++) delays[0] += delays[i];
+    if (delays.size() != old_size) InvalidateLayout();
+  }
+
+  int NrCpus() { return rates.size() > 0 ? rates.size() - 1 : 0; }
+  size_t ColumnWidth() { return NrCpus() > 64 ? 2 : 6; }
+ public:
+  RunqueueWidget() {
+    Sampler::ReadOnce("/proc/schedstat", [=](const char *buf, size_t len) {
+        ParseSchedstat(buf, len);
+      });
+    Reset();
+  }
+
+  std::vector<uint64_t> Count() override final {
+    return delays;
+  }
+
+  size_t Width() final override {
+    if (delays.size() < 2) return 0;
+    return kTextWidth + (ColumnWidth() + 1) * NrCpus();
+  }
+  void Render(RenderContext *ctx) final override {
+    if (delays.size() < 2 || rates.empty()) return;
+    char str[32];
+    size_t len = Format(str, sizeof(str), "RQ: %.1fms/s", rates[0] / 1e6);
+    ctx->DrawText(this, str, len);
+
+    // A full column is a second of waiting per second, more than that means
+    // several tasks queued at once.
+    size_t w = ColumnWidth();
+    for (int cpu = 1; cpu <= NrCpus(); cpu++) {
+      ctx
+          ->SetColor(0xE0 << 8, 0x50 << 8, 0x50 << 8)
+          ->DrawColumn(this, kTextWidth + (w + 1) * (cpu - 1), w,
+                       std::min(1.0, rates[cpu] / 1e9));
+    }
+    ctx->ResetColor();
+  }
+  void OnAdd(Bar *bar) final override {
+    bar->RegisterSampledFile(
+        "/proc/schedstat", [=](const char *buf, size_t len) { ParseSchedstat(buf, len); },
+        65536);
+    BaseRateWidget::OnAdd(bar);
+
+    // Milliseconds of waiting per second, "runqueue" for the whole machine
+    // and "runqueueN" for each core.
+    std::vector<double *> waits;
+    waits.push_back(bar->RegisterMetric(this, "runqueue"));
+    for (int cpu = 0; cpu < NrCpus(); cpu++) {
+      waits.push_back(bar->RegisterMetric(this, "runqueue" + std::to_string(cpu)));
+    }
+    bar->RegisterPerSecondRefresh([=]() {
+        for (size_t i = 0; i < waits.size() && i < rates.size(); i++) {
+          *waits[i] = rates[i] / 1e6;
+        }
+      });
+  }
+};
+
+template <> Widget *Factory<Widget, RunqueueKind>::Construct() { return new RunqueueWidget(); }
+
+std::vector<std::string> WidgetConfig::g_mounts;
+
+// Space left on the mounts given with -f, or on every real filesystem.
+class FilesystemWidget : public Widget, public StringUtils {
+  // statvfs() on a dead network mount blocks until it times out, so every
+  // mount has a thread of its own, and a stuck one only greys out its own
+  // entry. The bar asks for a pass every tick and shows whatever came back.
+  struct Probe {
+    std::string path;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool requested = false, stopped = false;
+    uint64_t total = 0, avail = 0, updated = 0;
+
+    // The thread holds on to the probe, it may be stuck long after the
+    // mount is gone.
+    static void Work(std::shared_ptr<Probe> p) {
+      while (true) {
+        {
+          std::unique_lock<std::mutex> l(p->mutex);
+          p->cv.wait(l, [=]() { return p->requested || p->stopped; });
+          if (p->stopped) return;
+          p->requested = false;
+        }
+        struct statvfs st;
+        if (statvfs(p->path.c_str(), &st) < 0) continue;
+        std::lock_guard<std::mutex> l(p->mutex);
+        p->total = st.f_blocks * st.f_frsize;
+        p->avail = st.f_bavail * st.f_frsize;
+        p->updated = NowNanos();
+      }
+    }
+    void Request() {
+      std::lock_guard<std::mutex> l(mutex);
+      requested = true;
+      cv.notify_one();
+    }
+    void Stop() {
+      std::lock_guard<std::mutex> l(mutex);
+      stopped = true;
+      cv.notify_one();
+    }
+  };
+
+  struct Mount {
+    std::string path;
+    uint64_t total = 0, avail = 0;
+    uint64_t updated = 0; // 0 until statvfs() returned once
+    double *metric = nullptr;
+    std::shared_ptr<Probe> probe;
+  };
+  std::vector<Mount> mounts;
+  std::map<std::string, double *> metrics;
+  int mountinfo_fd;
+
+  static const size_t kMountWidth = 90;
+  // Older than this and the numbers are shown as stale.
+  static const uint64_t kStale = 5000000000ULL;
+
+  static bool IsVirtual(const std::string &type) {
+    static const char *types[] = {
+      "proc", "sysfs", "devtmpfs", "devpts", "tmpfs", "ramfs", "cgroup", "cgroup2",
+      "securityfs", "debugfs", "tracefs", "pstore", "bpf", "mqueue", "hugetlbfs",
+      "configfs", "fusectl", "autofs", "binfmt_misc", "efivarfs", "nsfs", "squashfs",
+      "rpc_pipefs", "selinuxfs", "overlay", "fuse.gvfsd-fuse", "fuse.portal",
+    };
+    for (auto t: types) {
+      if (type == t) return true;
+    }
+    return false;
+  }
+
+  // Mount points have spaces and such escaped as \ooo.
+  static std::string Unescape(const std::string &str) {
+    std::string res;
+    for (size_t i = 0; i < str.length(); i++) {
+      if (str[i] == '\\' && i + 3 < str.length()) {
+        res += (char) std::stoi(str.substr(i + 1, 3), nullptr, 8);
+        i += 3;
+      } else {
+        res += str[i];
+      }
+    }
+    return res;
+  }
+
+  // Only runs when the mount table changed, not every tick.
+  void Reload() {
+    std::vector<std::string> found;
+    std::vector<std::string> devices;
+    Sampler::ReadOnce("/proc/self/mountinfo", [&](const char *buf, size_t len) {
+        std::istringstream fin(std::string(buf, len));
+        for (std::string line; std::getline(fin, line); ) {
+          // id parent major:minor root mount-point options [optional...] - type source
+          auto arr = Split(line, ' ');
+          auto sep = std::find(arr.begin(), arr.end(), "-");
+          if (arr.size() < 5 || sep == arr.end() || sep + 1 == arr.end()) continue;
+          auto path = Unescape(arr[4]);
+          if (!WidgetConfig::g_mounts.empty()) {
+            auto &want = WidgetConfig::g_mounts;
+            if (std::find(want.begin(), want.end(), path) == want.end()) continue;
+          } else {
+            // Bind mounts show the same filesystem again.
+            if (IsVirtual(*(sep + 1))) continue;
+            if (std::find(devices.begin(), devices.end(), arr[2]) != devices.end()) continue;
+          }
+          devices.push_back(arr[2]);
+          found.erase(std::remove(found.begin(), found.end(), path), found.end());
+          found.push_back(path);
+        }
+      });
+
+    std::vector<Mount> next;
+    for (auto &path: found) {
+      Mount m;
+      m.path = path;
+      for (auto &old: mounts) {
+        if (old.path == path) m = old;
+      }
+      if (!m.probe) {
+        m.probe = std::make_shared<Probe>();
+        m.probe->path = path;
+        std::thread(&Probe::Work, m.probe).detach();
+        m.probe->Request();
+      }
+      next.push_back(m);
+    }
+    for (auto &old: mounts) {
+      if (std::find(found.begin(), found.end(), old.path) != found.end()) continue;
+      old.probe->Stop();
+      // Unmounted, rules on it should not keep firing.
+      if (old.metric) *old.metric = 0;
+    }
+    mounts.swap(next);
+    InvalidateLayout();
+  }
+
+  // Used percent as "fs<mount point>", e.g. "fs/var", for mounts as they
+  // show up.
+  void RegisterMetrics(Bar *bar) {
+    for (auto &m: mounts) {
+      if (m.metric) continue;
+      auto it = metrics.find(m.path);
+      if (it == metrics.end())
+        it = metrics.emplace(m.path, bar->RegisterMetric(this, "fs" + m.path)).first;
+      m.metric = it->second;
+    }
+  }
+
+  void Collect() {
+    for (auto &m: mounts) {
+      auto &p = *m.probe;
+      {
+        std::lock_guard<std::mutex> l(p.mutex);
+        m.total = p.total;
+        m.avail = p.avail;
+        m.updated = p.updated;
+      }
+      p.Request();
+    }
+  }
+
+  static int UsedPercent(const Mount &m) {
+    if (m.total == 0) return 0;
+    return (m.total - m.avail) * 100 / m.total;
+  }
+ public:
+  FilesystemWidget() {
+    mountinfo_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    Reload();
+  }
+
+  void Refresh() final override {}
+  size_t Width() final override {
+    return mounts.size() * kMountWidth;
+  }
+  void Render(RenderContext *ctx) final override {
+    auto now = NowNanos();
+    for (size_t i = 0; i < mounts.size(); i++) {
+      auto &m = mounts[i];
+      char str[32];
+      size_t len;
+      if (m.updated == 0) {
+        len = Format(str, sizeof(str), "%.10s ?", m.path.c_str());
+      } else {
+        len = Format(str, sizeof(str), "%.10s %d%%", m.path.c_str(), UsedPercent(m));
+      }
+      if (m.updated == 0 || now - m.updated > kStale)
+        ctx->SetColor(0x99 << 8, 0x99 << 8, 0x99 << 8);
+      else if (UsedPercent(m) >= 90)
+        ctx->SetColor(0xE0 << 8, 0x50 << 8, 0x50 << 8);
+      ctx->DrawText(this, str, len, i * kMountWidth)->ResetColor();
+    }
+  }
+  void OnAdd(Bar *bar) final override {
+    if (mountinfo_fd >= 0) {
+      // The kernel flags mountinfo with POLLPRI | POLLERR on every change.
+      bar->RegisterWatch(mountinfo_fd, POLLPRI, [=]() {
+          Reload();
+          RegisterMetrics(bar);
+        });
+    }
+
+    // Used percent of the fullest mount as "fs", see RegisterMetrics() for
+    // the others.
+    auto fullest = bar->RegisterMetric(this, "fs");
+    RegisterMetrics(bar);
+    bar->RegisterPerSecondRefresh([=]() {
+        Collect();
+        *fullest = 0;
+        for (auto &m: mounts) {
+          if (m.updated == 0) continue;
+          if (m.metric) *m.metric = UsedPercent(m);
+          *fullest = std::max<double>(*fullest, UsedPercent(m));
+        }
+      });
+  }
+};
+
+template <> Widget *Factory<Widget, FilesystemKind>::Construct() { return new FilesystemWidget(); }
+
+// TCP trouble rather than throughput: retransmits, resets, listen queue
+// overflows and how many connections sit in each state.
+class TcpWidget : public BaseRateWidget, public StringUtils {
+  // A "Tcp: name name ..." line followed by "Tcp: value value ...". Keys are
+  // looked up in the header only when it changes, each tick just walks the
+  // values up to the last column we need.
+  struct Table {
+    const char *prefix;
+    std::vector<const char *> keys;
+    std::string header;
+    std::vector<int> columns;
+    std::vector<int64_t> values;
+    int last = -1;
+
+    Table(const char *prefix, std::vector<const char *> keys)
+        : prefix(prefix), keys(keys), columns(keys.size(), -1), values(keys.size(), 0) {}
+
+    void Parse(const char *buf) {
+      auto p = strstr(buf, prefix);
+      if (p == nullptr) return;
+      auto eol = strchr(p, '\n');
+      if (eol == nullptr) return;
+      if (header.compare(0, std::string::npos, p, eol - p) != 0) {
+        header.assign(p, eol - p);
+        std::istringstream fin(header);
+        std::string name;
+        fin >> name; // the prefix
+        columns.assign(keys.size(), -1);
+        last = -1;
+        for (int col = 0; fin >> name; col++) {
+          for (size_t k = 0; k < keys.size(); k++) {
+            if (name != keys[k]) continue;
+            columns[k] = col;
+            last = std::max(last, col);
+          }
+        }
+      }
+      auto v = eol + 1;
+      size_t len = strlen(prefix);
+      if (strncmp(v, prefix, len) != 0) return;
+      // Not ReadColumns(), some values (MaxConn) are negative.
+      v += len;
+      for (int col = 0; col <= last; col++) {
+        char *end;
+        int64_t value = strtoll(v, &end, 10);
+        if (end == v) break;
+        for (size_t k = 0; k < keys.size(); k++) {
+          if (columns[k] == col) values[k] = value;
+        }
+        v = end;
+      }
+    }
+  };
+
+  Table tcp{"Tcp: ", {"RetransSegs", "OutSegs", "EstabResets", "CurrEstab"}};
+  Table ext{"TcpExt: ", {"ListenOverflows"}};
+  enum : int {
+    Retrans, OutSegs, Resets, Overflows, NrCounters,
+  };
+
+  // Counting states needs a walk over all sockets, sock_diag does that in
+  // binary and filters by state in the kernel. Established comes from
+  // CurrEstab instead, it is usually the bulk of them. A busy server can
+  // still have 100k sockets in TIME_WAIT, so the dump runs on a thread of
+  // its own and the bar shows the last count.
+  int diag_fd; // the dumper's only, with the two below
+  bool ipv6 = true;
+  std::vector<char> nlbuf;
+  uint64_t dump_time_wait = 0, dump_close_wait = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool requested = false;
+  uint64_t read_time_wait = 0, read_close_wait = 0;
+  uint64_t time_wait = 0, close_wait = 0;
+
+  static const size_t kTextWidth = 300;
+
+  // 0 when done, the errno when the kernel refuses the dump, or -1 when the
+  // socket is out of sync.
+  int Dump(int family) {
+    struct {
+      struct nlmsghdr nlh;
+      struct inet_diag_req_v2 req;
+    } msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.nlh.nlmsg_len = sizeof(msg);
+    msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    msg.req.sdiag_family = family;
+    msg.req.sdiag_protocol = IPPROTO_TCP;
+    msg.req.idiag_states = (1 << TCP_TIME_WAIT) | (1 << TCP_CLOSE_WAIT);
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (sendto(diag_fd, &msg, sizeof(msg), 0, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+      return -1;
+    while (true) {
+      ssize_t rs = recv(diag_fd, nlbuf.data(), nlbuf.size(), 0);
+      if (rs < 0 && errno == EINTR) continue;
+      if (rs <= 0) return -1;
+      for (auto h = (struct nlmsghdr *) nlbuf.data(); NLMSG_OK(h, rs); h = NLMSG_NEXT(h, rs)) {
+        if (h->nlmsg_type == NLMSG_DONE) return 0;
+        if (h->nlmsg_type == NLMSG_ERROR) {
+          auto err = (struct nlmsgerr *) NLMSG_DATA(h);
+          return err->error < 0 ? -err->error : -1;
+        }
+        auto d = (struct inet_diag_msg *) NLMSG_DATA(h);
+        if (d->idiag_state == TCP_TIME_WAIT) dump_time_wait++;
+        else if (d->idiag_state == TCP_CLOSE_WAIT) dump_close_wait++;
+      }
+    }
+  }
+
+  void CountStates() {
+    dump_time_wait = dump_close_wait = 0;
+    if (diag_fd >= 0) {
+      int ret = Dump(AF_INET);
+      if (ret == 0 && ipv6) {
+        ret = Dump(AF_INET6);
+        // No IPv6 or no inet6_diag, it will not change while we run.
+        if (ret > 0) ipv6 = false;
+      }
+      if (ret < 0) {
+        // Out of sync with the kernel, start over with a fresh socket.
+        close(diag_fd);
+        OpenDiag();
+      }
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    read_time_wait = dump_time_wait;
+    read_close_wait = dump_close_wait;
+  }
+
+  void Work() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> l(mutex);
+        cv.wait(l, [=]() { return requested; });
+        requested = false;
+      }
+      CountStates();
+    }
+  }
+
+  void Request() {
+    std::lock_guard<std::mutex> l(mutex);
+    requested = true;
+    cv.notify_one();
+  }
+
+  void OpenDiag() {
+    diag_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (diag_fd < 0) return;
+    // The kernel answers right away, but never hang the bar on it.
+    struct timeval tv = {0, 100000};
+    setsockopt(diag_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  int64_t Rate(int i) { return i < rates.size() ? rates[i] : 0; }
+  // Percent of segments sent that were retransmits.
+  double RetransPercent() {
+    return Rate(OutSegs) > 0 ? 100.0 * Rate(Retrans) / Rate(OutSegs) : 0;
+  }
+ public:
+  TcpWidget() : nlbuf(32768) {
+    Sampler::ReadOnce("/proc/net/snmp", [=](const char *buf, size_t len) { tcp.Parse(buf); });
+    Sampler::ReadOnce("/proc/net/netstat", [=](const char *buf, size_t len) { ext.Parse(buf); });
+    OpenDiag();
+    Reset();
+  }
+
+  std::vector<uint64_t> Count() override final {
+    return {(uint64_t) tcp.values[0], (uint64_t) tcp.values[1], (uint64_t) tcp.values[2],
+            (uint64_t) ext.values[0]};
+  }
+
+  size_t Width() final override {
+    return kTextWidth;
+  }
+  void Render(RenderContext *ctx) final override {
+    char str[96];
+    size_t len = Format(str, sizeof(str),
+                        "TCP rtx %.1f%% rst %lld ovf %lld est %lld tw %llu cw %llu",
+                        RetransPercent(), (long long) Rate(Resets), (long long) Rate(Overflows),
+                        (long long) tcp.values[3], (unsigned long long) time_wait,
+                        (unsigned long long) close_wait);
+    if (Rate(Overflows) > 0 || RetransPercent() >= 1)
+      ctx->SetColor(0xE0 << 8, 0x50 << 8, 0x50 << 8);
+    ctx->DrawText(this, str, len)->ResetColor();
+  }
+  void OnAdd(Bar *bar) final override {
+    bar->RegisterSampledFile(
+        "/proc/net/snmp", [=](const char *buf, size_t len) { tcp.Parse(buf); }, 8192);
+    bar->RegisterSampledFile(
+        "/proc/net/netstat", [=](const char *buf, size_t len) { ext.Parse(buf); }, 8192);
+    BaseRateWidget::OnAdd(bar);
+
+    auto retrans = bar->RegisterMetric(this, "tcp.retrans");
+    auto resets = bar->RegisterMetric(this, "tcp.resets");
+    auto overflows = bar->RegisterMetric(this, "tcp.overflows");
+    auto estab = bar->RegisterMetric(this, "tcp.estab");
+    auto tw = bar->RegisterMetric(this, "tcp.timewait");
+    auto cw = bar->RegisterMetric(this, "tcp.closewait");
+    std::thread(&TcpWidget::Work, this).detach();
+    Request();
+    bar->RegisterPerSecondRefresh([=]() {
+        {
+          std::lock_guard<std::mutex> l(mutex);
+          time_wait = read_time_wait;
+          close_wait = read_close_wait;
+        }
+        Request();
+        *retrans = RetransPercent();
+        *resets = Rate(Resets);
+        *overflows = Rate(Overflows);
+        *estab = tcp.values[3];
+        *tw = time_wait;
+        *cw = close_wait;
+      });
+  }
+};
+
+template <> Widget *Factory<Widget, TcpKind>::Construct() { return new TcpWidget(); }
+
 }